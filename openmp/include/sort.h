@@ -0,0 +1,56 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+// Kernels and loaders of sort.c shared with other drivers (see sort_mpi.c).
+// Building sort.c with SORT_NO_MAIN leaves out its command line driver.
+
+#define LENGTH 8
+#define MAX_KEYS 1073741824L // Most keys in one buffer, as sort indices are int
+
+extern int task_threshold;
+extern int csv_mode;
+extern int packed_mode;
+extern int fout;
+extern int output_shared;
+extern off_t output_offset;
+extern const char *input_data, *input_body;
+extern size_t input_size;
+extern char *strings;
+extern uint64_t *keys;
+extern int keys_packed;
+extern long int N;
+
+static inline uint64_t toBigEndian(uint64_t v)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    return __builtin_bswap64(v);
+#else
+    return v;
+#endif
+}
+
+// Bytes of a packed key up to its zero padding.
+static inline int keyLength(uint64_t key)
+{
+    return key == 0 ? 0 : LENGTH - __builtin_ctzll(key) / 8;
+}
+
+const char *lineStart(const char *body, const char *end, long int offset);
+void mapInput(const char *input_file);
+void unmapInput(void);
+long int parseLines(const char *begin, const char *end, char *dst, long int capacity, int packed, long int *line_start);
+void *allocBuffer(size_t size);
+void freeBuffer(void *buf, size_t size);
+
+int usesPackedKeys(const char *method);
+int requiresPowerOfTwo(const char *method);
+void sort(const char *method);
+void mergeKeysParallel(const uint64_t *src, uint64_t *dst, int low, int mid, int high);
+int compareUint64(const void *a, const void *b);
+
+size_t outputSize(void);
+void writeOutput(void);
+void formatOutput(char *buf);
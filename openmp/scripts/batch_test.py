@@ -2,7 +2,6 @@
 import csv
 import os
 import subprocess
-import statistics
 import sys
 
 if len(sys.argv) != 2:
@@ -15,16 +14,20 @@ input_files = [f"in_{num}.in" for num in [
     256, 512, 1024, 2048, 4096, 8192, 16384, 32768,
     65536, 131072, 262144, 524288, 1048576, 2097152, 4194304, 8388608, 16777216
 ]]
-# Only used for parallel sort methods.
-thresholds = [1024, 2048, 4096]
+# Only used for parallel sort methods. "auto" lets the binary calibrate its own threshold.
+thresholds = [1024, 2048, 4096, "auto"]
 
 # For sequential sorts, these parameters are not varied.
 sequential_thr = [1]
 sequential_thresholds = [0]  # Dummy value; not used in sequential routines.
 repetitions = 5
+warmups = 1
 
 # Define the sort methods to test.
-sort_methods = ["bitonic", "bitonic_parallel", "mergesort", "mergesort_parallel"]
+sort_methods = ["bitonic", "bitonic_parallel", "bitonic_blocked", "bitonic_dataflow", "bitonic_static", "mergesort",
+                "mergesort_parallel", "radix_parallel", "samplesort_parallel", "counting_parallel"]
+# Parallel methods that do not use the task threshold.
+untasked_methods = ["bitonic_blocked", "bitonic_static", "radix_parallel", "samplesort_parallel", "counting_parallel"]
 
 output_csv = "batch_results.csv"
 
@@ -39,60 +42,47 @@ thread_counts.reverse()
 
 print(f"Using thread counts: {thread_counts}")
 
+# Each (method, input) pair is one process: the binary loads the input once and sweeps the thread counts and
+# thresholds itself, with warmup runs before the timed repetitions (see -bench in sort.c).
 with open(output_csv, mode="w", newline='') as csvfile:
     csvwriter = csv.writer(csvfile)
     csvwriter.writerow(["sort_method", "input_file", "N", "task_threshold", "omp_num_threads",
-                        "repetitions", "mean_time", "std_deviation", "individual_times"])
-    
+                        "repetitions", "mean_time", "std_deviation", "individual_times", "mean_load_time", "mean_write_time",
+                        "min_time", "median_time"])
+
     for sort_method in sort_methods:
         if sort_method in ["bitonic", "mergesort"]:
             thr_list = sequential_thr
             thres_list = sequential_thresholds
+        elif sort_method in untasked_methods:
+            thr_list = thread_counts
+            thres_list = sequential_thresholds
         else:
             thr_list = thread_counts
             thres_list = thresholds
 
         for input_file in input_files:
-            for thr in thr_list:
-                for thres in thres_list:
-                    times = []
-                    reported_N = None
-
-                    for rep in range(repetitions):
-                        env = os.environ.copy()
-                        env["OMP_NUM_THREADS"] = str(thr)
-                        env["OMP_PROC_BIND"] = "TRUE"
-                        
-                        cmd = [binary, "-i", input_file, "-t", str(thres), "-csv", "-sort", sort_method]
-                        try:
-                            result = subprocess.run(cmd, env=env, stdout=subprocess.PIPE, 
-                                                    stderr=subprocess.PIPE, universal_newlines=True, check=True)
-                        except subprocess.CalledProcessError as e:
-                            print(f"Error running command: {' '.join(cmd)}\nError: {e.stderr}")
-                            continue
-
-                        lines = result.stdout.strip().splitlines()
-                        for line in lines:
-                            if line.startswith("input_file") or line.startswith("sort_method"):
-                                continue
-
-                            parts = line.split(",")
-                            if len(parts) == 5:
-                                _, N_val, _, _, time_val = parts
-                                try:
-                                    runtime = float(time_val)
-                                    times.append(runtime)
-                                    reported_N = N_val
-                                except ValueError:
-                                    pass
+            env = os.environ.copy()
+            env["OMP_PROC_BIND"] = "TRUE"
 
-                    if times:
-                        mean_time = statistics.mean(times)
-                        std_dev = statistics.stdev(times) if len(times) > 1 else 0.0
+            cmd = [binary, "-i", input_file, "-csv", "-sort", sort_method, "-bench", str(repetitions),
+                   "-warmup", str(warmups), "-threads", ",".join(map(str, thr_list)),
+                   "-t", ",".join(map(str, thres_list))]
+            try:
+                result = subprocess.run(cmd, env=env, stdout=subprocess.PIPE,
+                                        stderr=subprocess.PIPE, universal_newlines=True, check=True)
+            except subprocess.CalledProcessError as e:
+                print(f"Error running command: {' '.join(cmd)}\nError: {e.stderr}")
+                continue
 
-                        csvwriter.writerow([sort_method, input_file, reported_N, thres, thr, repetitions,
-                                            f"{mean_time:.6f}", f"{std_dev:.6f}", times])
-                        print(f"Sort: {sort_method} | Config (input: {input_file}, threshold: {thres}, threads: {thr}) -> "
-                              f"Mean: {mean_time:.6f} s, Std Dev: {std_dev:.6f} s, Runs: {times}")
-                    else:
-                        print(f"Sort: {sort_method} | Config (input: {input_file}, threshold: {thres}, threads: {thr}) produced no data.")
+            rows = list(csv.DictReader(result.stdout.strip().splitlines()))
+            if not rows:
+                print(f"Sort: {sort_method} | Config (input: {input_file}) produced no data.")
+            for row in rows:
+                csvwriter.writerow([row["sort_method"], input_file, row["N"], row["task_threshold"],
+                                    row["omp_num_threads"], row["repetitions"], row["mean_time"],
+                                    row["std_deviation"], row["individual_times"], row["mean_load_time"],
+                                    row["mean_write_time"], row["min_time"], row["median_time"]])
+                print(f"Sort: {sort_method} | Config (input: {input_file}, threshold: {row['task_threshold']}, "
+                      f"threads: {row['omp_num_threads']}) -> Mean: {row['mean_time']} s, "
+                      f"Std Dev: {row['std_deviation']} s, Runs: {row['individual_times']}")
@@ -0,0 +1,78 @@
+import os
+import struct
+import sys
+
+# Binary container read and written by sort.c (see "Binary container format"):
+# magic, version, key width, sorted flag, reserved, count, then one zero-padded
+# slot of KEY_WIDTH bytes per key.
+MAGIC = b"SORTBIN\0"
+VERSION = 1
+KEY_WIDTH = 8
+HEADER = struct.Struct("<8sIIIIQ")
+
+
+def is_binary(path):
+    with open(path, 'rb') as f:
+        return f.read(len(MAGIC)) == MAGIC
+
+
+def text_to_binary(src, dst):
+    """
+    Converts a text input ("N" header, then one key per line) or text output
+    (one key per line) into a binary container. Keys are truncated to
+    KEY_WIDTH - 1 bytes, as the text loader of sort.c does.
+    """
+    with open(src, 'rb') as f:
+        lines = f.read().split(b"\n")
+    if lines and lines[-1] == b"":
+        lines.pop()
+    if src.endswith(".in") and lines:
+        count = int(lines[0])
+        keys = lines[1:count + 1]
+        if len(keys) < count:
+            raise ValueError(f"{src} has {len(keys)} elements, expected {count}")
+    else:
+        keys = lines
+    keys = [k.rstrip(b"\r")[:KEY_WIDTH - 1] for k in keys]
+    is_sorted = all(keys[i - 1] <= keys[i] for i in range(1, len(keys)))
+
+    with open(dst, 'wb') as f:
+        f.write(HEADER.pack(MAGIC, VERSION, KEY_WIDTH, int(is_sorted), 0, len(keys)))
+        for k in keys:
+            f.write(k.ljust(KEY_WIDTH, b"\0"))
+
+
+def binary_to_text(src, dst):
+    """
+    Converts a binary container back to text: an input file with an "N" header
+    if dst ends in ".in", otherwise one key per line like sort.c output.
+    """
+    with open(src, 'rb') as f:
+        data = f.read()
+    magic, version, width, _, _, count = HEADER.unpack_from(data)
+    if magic != MAGIC or version != VERSION:
+        raise ValueError(f"{src} is not a binary container")
+
+    with open(dst, 'wb') as f:
+        if dst.endswith(".in"):
+            f.write(f"{count}\n".encode())
+        for i in range(count):
+            slot = data[HEADER.size + i * width:HEADER.size + (i + 1) * width]
+            f.write(slot.split(b"\0", 1)[0] + b"\n")
+
+
+if __name__ == "__main__":
+    if len(sys.argv) != 3:
+        print("Usage: python convert.py <source> <destination>")
+        print("Binary sources are converted to text, text sources to binary.")
+        sys.exit(1)
+
+    src, dst = sys.argv[1], sys.argv[2]
+    if not os.path.isfile(src):
+        print(f"File not found: {src}")
+        sys.exit(1)
+
+    if is_binary(src):
+        binary_to_text(src, dst)
+    else:
+        text_to_binary(src, dst)
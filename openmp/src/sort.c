@@ -1,20 +1,50 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
 #include <math.h>
 #include <omp.h>
+#include <spawn.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-#define LENGTH 8
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+#include "sort.h"
 
 int task_threshold = 2048;
+int task_threshold_auto = 0; // Set by "-t auto", see tuneTaskThreshold()
 #define DEFAULT_CSV_MODE 0
+#define DEFAULT_PACKED_MODE 0
 
 #define OUTPUT_DIR "output/"
 #define INPUT_DIR "data/"
 #define DEFAULT_INPUT_FILE "in_16777216.in"
+#define TUNING_PROFILE_FILE ".task_threshold.profile"
 
-FILE *fin, *fout;
+int fout = -1;
+int output_shared = 0; // Set when several processes write slices of one output file
+off_t output_offset = 0; // Where this process' slice starts in the output file
+int input_fd;
+const char *input_data, *input_body; // Mapped input file and the first line after its header
+size_t input_size;
 char *strings;
+uint64_t *keys; // Packed view of `strings`, one big-endian key per LENGTH-byte slot
+int keys_packed = 0; // Whether the buffer currently holds packed keys or strings
+long int *record_start; // Offset of every input line in the mapped file, kept for -argsort records
 long int N;
 
 unsigned long int powersOfTwo[] = {1,        2,        4,        8,         16,        32,        64,        128,
@@ -26,6 +56,166 @@ unsigned long int powersOfTwo[] = {1,        2,        4,        8,         16,
 #define DESCENDING 0
 
 int csv_mode = DEFAULT_CSV_MODE;
+long int memory_budget = 0; // Bytes, set by "-mem"; 0 sorts in memory
+int packed_mode = DEFAULT_PACKED_MODE;
+
+#define ARGSORT_NONE 0
+#define ARGSORT_PERMUTATION 1
+#define ARGSORT_RECORDS 2
+int argsort_mode = ARGSORT_NONE;
+int varlen_mode = 0;
+long int topk = 0;     // Set by "-topk K", 0 sorts everything
+int uniq_mode = 0;     // Set by "-uniq"
+int output_binary = 0; // Set by "-binary"
+int validate_mode = 0; // Set by "-validate"
+int input_binary = 0;  // Whether the mapped input is a binary container, see mapInput()
+int input_sorted = 0;  // Sorted flag of a binary input
+int numa_mode = 0;
+int bench_repetitions = 0; // Set by "-bench", 0 runs a single sort
+int bench_warmups = 1;
+const char *method_list, *threshold_list, *thread_list; // Comma-separated sweeps for -bench
+int numa_nodes = 0; // Set by "-numa N", otherwise read from sysfs
+const char *simd_kernel = "auto";
+
+#define STORE_NONE 0
+#define STORE_APPEND 1
+#define STORE_QUERY 2
+#define STORE_COMPACT 3
+int store_mode = STORE_NONE; // Set by "-append", "-query" or "-compact"
+const char *store_name;      // Store as given on the command line
+char store_dir[256];         // Its directory, under OUTPUT_DIR
+
+/*
+ * Run statistics ("-stats").
+ *
+ * Every OS thread that touches a counter claims its own cache-line sized slot
+ * on first use, so nested teams and the counters of different threads never
+ * share a line. The counters are only updated when stats_mode is set; the
+ * check is a predictable branch on a global. Compares and swaps are counted by
+ * the string compare-exchange and by the merge kernels; the packed bitonic
+ * kernels and the leaf introsort only count compares. The SIMD blocks count
+ * the compare-exchanges of their network, as the scalar blocks would. Merge
+ * time covers the merge kernels and the bitonic merge sweeps, but not
+ * the leaf sorts below them.
+ */
+
+#define STATS_MAX_THREADS 256
+
+typedef struct
+{
+    long int tasks_spawned;
+    long int tasks_executed;
+    long int compares;
+    long int swaps;
+    double merge_time; // Seconds spent in merge kernels and bitonic merge sweeps
+} __attribute__((aligned(64))) ThreadStats;
+
+int stats_mode = 0;
+ThreadStats thread_stats[STATS_MAX_THREADS];
+int stats_slots = 0;
+static __thread int stats_slot = -1;
+
+static inline ThreadStats *threadStats(void)
+{
+    if (stats_slot < 0)
+        stats_slot = __atomic_fetch_add(&stats_slots, 1, __ATOMIC_RELAXED) % STATS_MAX_THREADS;
+    return &thread_stats[stats_slot];
+}
+
+#define STATS_ADD(field, n)                                                                                            \
+    do                                                                                                                 \
+    {                                                                                                                  \
+        if (stats_mode)                                                                                                \
+            threadStats()->field += (n);                                                                               \
+    } while (0)
+
+#define STATS_TIMER_START() (stats_mode ? omp_get_wtime() : 0.0)
+#define STATS_TIMER_STOP(start) STATS_ADD(merge_time, omp_get_wtime() - (start))
+
+/*
+ * Hardware counters for -stats. Each thread of the first team opens its own
+ * instruction and cache-miss counters, which any thread can read later, so a
+ * phase is measured by summing the counters of all threads before and after
+ * it. Counters that cannot be opened (no PMU, perf_event_paranoid) read as -1.
+ */
+
+#define PERF_COUNTERS 2 // Instructions, cache misses
+
+int perf_fd[STATS_MAX_THREADS][PERF_COUNTERS];
+int perf_threads = 0;
+
+void openPerfCounters(void)
+{
+#ifdef __linux__
+    static const unsigned long long config[PERF_COUNTERS] = {PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES};
+#pragma omp parallel
+    {
+        int tid = omp_get_thread_num();
+#pragma omp single
+        perf_threads = omp_get_num_threads() < STATS_MAX_THREADS ? omp_get_num_threads() : STATS_MAX_THREADS;
+        for (int c = 0; c < PERF_COUNTERS && tid < STATS_MAX_THREADS; c++)
+        {
+            struct perf_event_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = config[c];
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            perf_fd[tid][c] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        }
+    }
+#endif
+}
+
+// Sums counter c over all threads, or returns -1 if any thread has no counter.
+long long readPerfCounter(int c)
+{
+    long long total = perf_threads > 0 ? 0 : -1;
+    for (int t = 0; t < perf_threads; t++)
+    {
+        long long value;
+        if (perf_fd[t][c] < 0 || read(perf_fd[t][c], &value, sizeof(value)) != sizeof(value))
+            return -1;
+        total += value;
+    }
+    return total;
+}
+
+void closePerfCounters(void)
+{
+    for (int t = 0; t < perf_threads; t++)
+        for (int c = 0; c < PERF_COUNTERS; c++)
+            if (perf_fd[t][c] >= 0)
+                close(perf_fd[t][c]);
+}
+
+#define PHASE_LOAD 0
+#define PHASE_SORT 1
+#define PHASE_WRITE 2
+#define PHASES 3
+
+long long phase_counter[PHASES][PERF_COUNTERS];
+long long phase_start[PERF_COUNTERS];
+
+void startPhase(void)
+{
+    if (!stats_mode)
+        return;
+    for (int c = 0; c < PERF_COUNTERS; c++)
+        phase_start[c] = readPerfCounter(c);
+}
+
+void endPhase(int phase)
+{
+    if (!stats_mode)
+        return;
+    for (int c = 0; c < PERF_COUNTERS; c++)
+    {
+        long long now = readPerfCounter(c);
+        phase_counter[phase][c] = now < 0 || phase_start[c] < 0 ? -1 : now - phase_start[c];
+    }
+}
 
 void parseCommandLineArguments(int argc, char **argv, char *input_file, char *sort_method)
 {
@@ -38,22 +228,115 @@ void parseCommandLineArguments(int argc, char **argv, char *input_file, char *so
         }
         else if (strcmp(argv[arg], "-t") == 0 && arg + 1 < argc)
         {
-            task_threshold = atoi(argv[arg + 1]);
+            if (strcmp(argv[arg + 1], "auto") == 0)
+                task_threshold_auto = 1;
+            else
+                task_threshold = atoi(argv[arg + 1]);
+            threshold_list = argv[arg + 1];
             arg++;
         }
         else if (strcmp(argv[arg], "-csv") == 0)
         {
             csv_mode = 1;
         }
+        else if (strcmp(argv[arg], "-mem") == 0 && arg + 1 < argc)
+        {
+            memory_budget = atol(argv[arg + 1]) * 1024 * 1024;
+            arg++;
+        }
+        else if (strcmp(argv[arg], "-argsort") == 0 && arg + 1 < argc)
+        {
+            if (strcmp(argv[arg + 1], "perm") == 0)
+                argsort_mode = ARGSORT_PERMUTATION;
+            else if (strcmp(argv[arg + 1], "records") == 0)
+                argsort_mode = ARGSORT_RECORDS;
+            else
+            {
+                fprintf(stderr, "Unknown argsort output: %s\n", argv[arg + 1]);
+                exit(EXIT_FAILURE);
+            }
+            arg++;
+        }
+        else if (strcmp(argv[arg], "-bench") == 0 && arg + 1 < argc)
+        {
+            bench_repetitions = atoi(argv[arg + 1]);
+            arg++;
+        }
+        else if (strcmp(argv[arg], "-warmup") == 0 && arg + 1 < argc)
+        {
+            bench_warmups = atoi(argv[arg + 1]);
+            arg++;
+        }
+        else if (strcmp(argv[arg], "-threads") == 0 && arg + 1 < argc)
+        {
+            thread_list = argv[arg + 1];
+            arg++;
+        }
+        else if (strcmp(argv[arg], "-numa") == 0)
+        {
+            numa_mode = 1;
+            if (arg + 1 < argc && argv[arg + 1][0] >= '1' && argv[arg + 1][0] <= '9')
+                numa_nodes = atoi(argv[++arg]);
+        }
+        else if (strcmp(argv[arg], "-topk") == 0 && arg + 1 < argc)
+        {
+            topk = atol(argv[arg + 1]);
+            arg++;
+        }
+        else if (strcmp(argv[arg], "-uniq") == 0)
+        {
+            uniq_mode = 1;
+        }
+        else if (strcmp(argv[arg], "-binary") == 0)
+        {
+            output_binary = 1;
+        }
+        else if (strcmp(argv[arg], "-append") == 0 && arg + 1 < argc)
+        {
+            store_mode = STORE_APPEND;
+            store_name = argv[++arg];
+        }
+        else if (strcmp(argv[arg], "-query") == 0 && arg + 1 < argc)
+        {
+            store_mode = STORE_QUERY;
+            store_name = argv[++arg];
+        }
+        else if (strcmp(argv[arg], "-compact") == 0 && arg + 1 < argc)
+        {
+            store_mode = STORE_COMPACT;
+            store_name = argv[++arg];
+        }
+        else if (strcmp(argv[arg], "-validate") == 0)
+        {
+            validate_mode = 1;
+        }
+        else if (strcmp(argv[arg], "-stats") == 0)
+        {
+            stats_mode = 1;
+        }
+        else if (strcmp(argv[arg], "-varlen") == 0)
+        {
+            varlen_mode = 1;
+        }
+        else if (strcmp(argv[arg], "-packed") == 0)
+        {
+            packed_mode = 1;
+        }
+        else if (strcmp(argv[arg], "-simd") == 0 && arg + 1 < argc)
+        {
+            simd_kernel = argv[arg + 1];
+            arg++;
+        }
         else if (strcmp(argv[arg], "-sort") == 0 && arg + 1 < argc)
         {
             strncpy(sort_method, argv[arg + 1], 32);
             sort_method[31] = '\0'; // Ensure null-termination
+            method_list = argv[arg + 1];
             arg++;
         }
         else
         {
-            fprintf(stderr, "Usage: %s [-i input_file] [-t task_threshold] [-csv] [-sort method]\n", argv[0]);
+            fprintf(stderr, "Usage: %s [-i input_file] [-t task_threshold|auto] [-csv] [-mem MiB] [-packed] [-varlen] [-binary] [-topk K] [-uniq] [-append|-query|-compact store] [-validate] [-stats] [-numa [nodes]] [-bench reps [-warmup n] [-threads list]] [-argsort perm|records] [-simd auto|avx2|sse4.2|scalar] [-sort method]\n", argv[0]);
             exit(EXIT_FAILURE);
         }
     }
@@ -61,21 +344,13 @@ void parseCommandLineArguments(int argc, char **argv, char *input_file, char *so
 
 void openfiles(char *input_file)
 {
-    fin = fopen(input_file, "r");
-    if (fin == NULL)
-    {
-        perror("fopen fin");
-        fprintf(stderr, "Error opening input file: %s\n", input_file);
-        exit(EXIT_FAILURE);
-    }
-
     char output_file[256];
     snprintf(output_file, sizeof(output_file), OUTPUT_DIR "%s.out",
              strrchr(input_file, '/') ? strrchr(input_file, '/') + 1 : input_file);
-    fout = fopen(output_file, "w");
-    if (fout == NULL)
+    fout = open(output_file, O_RDWR | O_CREAT | O_TRUNC, 0644); // Readable too, for mapping binary output
+    if (fout < 0)
     {
-        perror("fopen fout");
+        perror("open fout");
         fprintf(stderr, "Error opening output file: %s\n", output_file);
         exit(EXIT_FAILURE);
     }
@@ -83,254 +358,4185 @@ void openfiles(char *input_file)
 
 void closefiles(void)
 {
-    fclose(fin);
-    fclose(fout);
+    if (fout >= 0)
+        close(fout);
 }
 
-void compare(int i, int j, int dir)
+/*
+ * Input loader.
+ *
+ * The input file is mapped read-only and its body is split into one byte range
+ * per thread, each moved forward to the next line start. Threads count the
+ * lines in their range, a prefix sum over the counts gives each thread the
+ * index of its first element, and the ranges are then parsed in parallel
+ * straight into the slots. When the sort runs on packed keys, the slots are
+ * filled with big-endian keys directly, so packKeys() has nothing left to do.
+ */
+
+const char *lineStart(const char *body, const char *end, long int offset)
 {
-    if (dir == (strcmp(strings + i * LENGTH, strings + j * LENGTH) > 0))
-    {
-        char t[LENGTH];
-        strcpy(t, strings + i * LENGTH);
-        strcpy(strings + i * LENGTH, strings + j * LENGTH);
-        strcpy(strings + j * LENGTH, t);
-    }
+    const char *p = body + offset;
+    if (p <= body)
+        return body;
+    if (p >= end)
+        return end;
+    if (p[-1] == '\n')
+        return p;
+    p = memchr(p, '\n', end - p);
+    return p ? p + 1 : end;
 }
 
-void bitonicMerge(int lo, int cnt, int dir)
+static long int countLines(const char *p, const char *end)
 {
-    if (cnt > 1)
+    long int lines = 0;
+    while (p < end)
     {
-        int k = cnt / 2;
-        int i;
-        for (i = lo; i < lo + k; i++)
-            compare(i, i + k, dir);
-        bitonicMerge(lo, k, dir);
-        bitonicMerge(lo + k, k, dir);
+        const char *nl = memchr(p, '\n', end - p);
+        if (nl == NULL)
+            return lines + 1; // Last line without a trailing newline
+        lines++;
+        p = nl + 1;
     }
+    return lines;
 }
 
-void bitonicMergeParallel(int lo, int cnt, int dir)
+// Walks the lines of [begin, end) in parallel. The range is split into one run
+// of whole lines per thread, threads count their lines, and a prefix sum over
+// the counts numbers them. `visit` is then called on each of the first
+// `capacity` lines with its length, less a trailing '\r'. Returns how many
+// lines the range holds. Inlined, so that `visit` is inlined in each loader.
+static inline __attribute__((always_inline)) long int walkLines(const char *begin, const char *end, long int capacity,
+                                                               void (*visit)(long int i, const char *line,
+                                                                             long int len, void *ctx),
+                                                               void *ctx)
 {
-    if (cnt > 1)
+    int max_threads = omp_get_max_threads();
+    long int *first = (long int *)malloc((max_threads + 1) * sizeof(long int));
+    if (first == NULL)
     {
-        int k = cnt / 2;
-        // #pragma omp parallel for // this makes it slower
-        for (int i = lo; i < lo + k; i++)
-        {
-            compare(i, i + k, dir);
-        }
+        perror("malloc line offsets");
+        exit(EXIT_FAILURE);
+    }
+    long int size = end - begin;
+    long int lines = 0;
 
-#pragma omp task firstprivate(lo, k) if (cnt > task_threshold)
+#pragma omp parallel
+    {
+        int tid = omp_get_thread_num();
+        int nthreads = omp_get_num_threads();
+        const char *from = lineStart(begin, end, size * tid / nthreads);
+        const char *to = lineStart(begin, end, size * (tid + 1) / nthreads);
+
+        first[tid + 1] = countLines(from, to);
+#pragma omp barrier
+#pragma omp single
         {
-            bitonicMergeParallel(lo, k, dir);
+            first[0] = 0;
+            for (int t = 1; t <= nthreads; t++)
+                first[t] += first[t - 1];
+            lines = first[nthreads];
         }
-#pragma omp task firstprivate(lo, k) if (cnt > task_threshold)
+
+        const char *p = from;
+        for (long int i = first[tid]; i < first[tid + 1] && i < capacity; i++)
         {
-            bitonicMergeParallel(lo + k, k, dir);
+            const char *nl = memchr(p, '\n', to - p);
+            const char *eol = nl ? nl : to;
+            long int len = eol - p;
+            if (len > 0 && p[len - 1] == '\r')
+                len--;
+            visit(i, p, len, ctx);
+            p = nl ? nl + 1 : to;
         }
-#pragma omp taskwait
     }
+
+    free(first);
+    return lines;
 }
 
-void recBitonicSort(int lo, int cnt, int dir)
+// Reads the element count header of a text input and returns the line after it.
+const char *parseHeader(const char *data, const char *end, long int *count)
 {
-    if (cnt > 1)
-    {
-        int k = cnt / 2;
-        recBitonicSort(lo, k, ASCENDING);
-        recBitonicSort(lo + k, k, DESCENDING);
-        bitonicMerge(lo, cnt, dir);
-    }
+    char *header_end;
+    *count = strtol(data, &header_end, 10);
+    return lineStart(header_end, end, 1);
 }
 
-void recBitonicSortParallel(int lo, int cnt, int dir)
+// Exits unless `count` elements can be loaded (a power of two of them, if required).
+void checkKeyCount(long int count, int power_of_two)
 {
-    if (cnt > 1)
+    if (count < 1 || count > MAX_KEYS || (power_of_two && powersOfTwo[(int)log2(count)] != count))
     {
-        int k = cnt / 2;
-#pragma omp task firstprivate(lo, k) if (cnt > task_threshold)
-        {
-            recBitonicSortParallel(lo, k, ASCENDING);
-        }
-#pragma omp task firstprivate(lo, k) if (cnt > task_threshold)
-        {
-            recBitonicSortParallel(lo + k, k, DESCENDING);
-        }
-#pragma omp taskwait
-        bitonicMergeParallel(lo, cnt, dir);
+        if (power_of_two)
+            printf("%ld is not a valid number: must be a power of 2 and less than %ld!\n", count, MAX_KEYS);
+        else
+            printf("%ld is not a valid number: must be positive and less than %ld!\n", count, MAX_KEYS);
+        exit(EXIT_FAILURE);
     }
 }
 
-void bitonicSort()
+typedef struct
 {
-    recBitonicSort(0, N, ASCENDING);
-}
+    char *dst;
+    int packed;
+    long int *line_start;
+} SlotTarget;
 
-void bitonicSortParallel()
+static void parseSlot(long int i, const char *line, long int len, void *ctx)
 {
-#pragma omp parallel
+    const SlotTarget *target = (const SlotTarget *)ctx;
+    char *slot = target->dst + i * LENGTH;
+    if (target->line_start != NULL)
+        target->line_start[i] = line - input_data;
+    if (len > LENGTH - 1)
+        len = LENGTH - 1; // Keep room for the terminator
+
+    if (target->packed)
     {
-#pragma omp single
-        {
-            recBitonicSortParallel(0, N, ASCENDING);
-        }
+        uint64_t key = 0;
+        for (long int c = 0; c < len; c++)
+            key = (key << 8) | (unsigned char)line[c];
+        *(uint64_t *)slot = key << (8 * (LENGTH - len));
+    }
+    else
+    {
+        memset(slot, 0, LENGTH);
+        memcpy(slot, line, len);
     }
 }
 
-void merge(int low, int mid, int high)
+/*
+ * Binary container format.
+ *
+ * A 32-byte header (magic, version, key width, sorted flag and count, all
+ * little-endian) is followed by `count` slots of `key_width` bytes, each
+ * holding a key zero-padded exactly like a slot of `strings`. Loading is a
+ * parallel copy out of the mapped file (plus a byte swap for packed keys) and
+ * writing a parallel copy into a shared mapping of the output file, so neither
+ * parses nor formats anything. scripts/convert.py converts to and from text.
+ */
+
+#define BINARY_MAGIC "SORTBIN\0"
+#define BINARY_VERSION 1
+
+typedef struct
 {
-    int n1 = mid - low;
-    int n2 = high - mid;
-    char *temp = (char *)malloc((n1 + n2) * LENGTH);
-    if (temp == NULL)
+    char magic[8];
+    uint32_t version;
+    uint32_t key_width;
+    uint32_t sorted;
+    uint32_t reserved;
+    uint64_t count;
+} BinaryHeader;
+
+// Recognizes a binary container in the mapped input and points input_body at its keys.
+static int mapBinaryInput(const char *input_file)
+{
+    BinaryHeader header;
+    if (input_size < sizeof(header) || memcmp(input_data, BINARY_MAGIC, sizeof(header.magic)) != 0)
+        return 0;
+    memcpy(&header, input_data, sizeof(header));
+    if (header.version != BINARY_VERSION || header.key_width != LENGTH ||
+        input_size < sizeof(header) + header.count * LENGTH)
     {
-        perror("malloc temp");
+        fprintf(stderr, "Input file %s is not a valid binary container (version %u, key width %u)\n", input_file,
+                header.version, header.key_width);
         exit(EXIT_FAILURE);
     }
-    int i = 0, j = 0;
-    while (i < n1 && j < n2)
+    N = header.count;
+    input_body = input_data + sizeof(header);
+    input_sorted = header.sorted != 0;
+    return 1;
+}
+
+void mapInput(const char *input_file)
+{
+    input_fd = open(input_file, O_RDONLY);
+    if (input_fd < 0)
     {
-        if (strcmp(strings + (low + i) * LENGTH, strings + (mid + j) * LENGTH) <= 0)
-        {
-            memcpy(temp + (i + j) * LENGTH, strings + (low + i) * LENGTH, LENGTH);
-            i++;
-        }
-        else
-        {
-            memcpy(temp + (i + j) * LENGTH, strings + (mid + j) * LENGTH, LENGTH);
-            j++;
-        }
+        perror("open input");
+        fprintf(stderr, "Error opening input file: %s\n", input_file);
+        exit(EXIT_FAILURE);
     }
-    while (i < n1)
+    struct stat st;
+    if (fstat(input_fd, &st) < 0 || st.st_size == 0)
     {
-        memcpy(temp + (i + j) * LENGTH, strings + (low + i) * LENGTH, LENGTH);
-        i++;
+        fprintf(stderr, "Error reading input file: %s\n", input_file);
+        exit(EXIT_FAILURE);
     }
-    while (j < n2)
+    input_size = st.st_size;
+    input_data = mmap(NULL, input_size, PROT_READ, MAP_PRIVATE, input_fd, 0);
+    if (input_data == MAP_FAILED)
     {
-        memcpy(temp + (i + j) * LENGTH, strings + (mid + j) * LENGTH, LENGTH);
-        j++;
+        perror("mmap input");
+        exit(EXIT_FAILURE);
     }
-    memcpy(strings + low * LENGTH, temp, (n1 + n2) * LENGTH);
-    free(temp);
-}
+    madvise((void *)input_data, input_size, MADV_SEQUENTIAL);
 
-void recMergeSort(int low, int high)
-{
-    if (high - low < 2)
+    input_binary = mapBinaryInput(input_file);
+    if (input_binary)
         return;
-    int mid = (low + high) / 2;
-    recMergeSort(low, mid);
-    recMergeSort(mid, high);
-    merge(low, mid, high);
+    input_body = parseHeader(input_data, input_data + input_size, &N);
 }
 
-void recMergeSortParallel(int low, int high)
+void unmapInput(void)
 {
-    if (high - low < 2)
-        return;
-    int mid = (low + high) / 2;
-#pragma omp task firstprivate(low, mid) if ((high - low) > task_threshold)
-    {
-        recMergeSortParallel(low, mid);
-    }
-#pragma omp task firstprivate(mid, high) if ((high - low) > task_threshold)
-    {
-        recMergeSortParallel(mid, high);
-    }
-#pragma omp taskwait
-    merge(low, mid, high);
+    munmap((void *)input_data, input_size);
+    close(input_fd);
 }
 
-void mergeSort()
+// Parses the lines of [begin, end) into consecutive slots of dst, at most
+// `capacity` of them, and returns how many lines the range holds. The offset of
+// every line in the mapped file is also stored in `line_start`, if given.
+long int parseLines(const char *begin, const char *end, char *dst, long int capacity, int packed, long int *line_start)
 {
-    recMergeSort(0, N);
+    SlotTarget target = {dst, packed, line_start};
+    return walkLines(begin, end, capacity, parseSlot, &target);
 }
 
-void mergeSortParallel()
+/*
+ * NUMA-aware buffers ("-numa").
+ *
+ * Pages are placed on the node of the thread that first writes them. Sort
+ * buffers are therefore mapped directly, advised to use transparent huge
+ * pages, and touched by the whole team with a static schedule, so that the
+ * i-th slice of the buffer lives next to the threads that sort it. With
+ * OMP_PROC_BIND=TRUE consecutive thread numbers fill a socket first, which is
+ * what the socket-aware split of mergesort_parallel relies on.
+ */
+
+#define NUMA_NODE_LIST "/sys/devices/system/node/online"
+
+int numaNodeCount(void)
 {
-#pragma omp parallel
+    if (numa_nodes > 0)
+        return numa_nodes;
+
+    // The list looks like "0-1" or "0,2-3"
+    int count = 1;
+    FILE *f = fopen(NUMA_NODE_LIST, "r");
+    if (f != NULL)
     {
-#pragma omp single
+        int first, last;
+        count = 0;
+        while (fscanf(f, "%d", &first) == 1)
         {
-            recMergeSortParallel(0, N);
+            last = first;
+            if (fscanf(f, "-%d", &last) != 1)
+                last = first;
+            count += last - first + 1;
+            if (fgetc(f) != ',')
+                break;
         }
+        fclose(f);
+        if (count < 1)
+            count = 1;
     }
+    numa_nodes = count;
+    return count;
 }
 
-void sort(const char *method)
+// Returns a zeroed buffer; with -numa its pages are first touched in parallel.
+void *allocBuffer(size_t size)
 {
-    if (strcmp(method, "bitonic") == 0)
-    {
-        bitonicSort();
-    }
-    else if (strcmp(method, "bitonic_parallel") == 0)
+    if (!numa_mode)
+        return calloc(1, size);
+
+    size_t length = size > 0 ? size : 1;
+    char *buf = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buf == MAP_FAILED)
+        return NULL;
+#ifdef MADV_HUGEPAGE
+    madvise(buf, length, MADV_HUGEPAGE); // Only a hint, the buffer works without it
+#endif
+    long int page = sysconf(_SC_PAGESIZE);
+    long int pages = (length + page - 1) / page;
+#pragma omp parallel for schedule(static)
+    for (long int i = 0; i < pages; i++)
+        buf[i * page] = 0;
+    return buf;
+}
+
+void freeBuffer(void *buf, size_t size)
+{
+    if (buf == NULL)
+        return;
+    if (numa_mode)
+        munmap(buf, size > 0 ? size : 1);
+    else
+        free(buf);
+}
+
+void loadInput(const char *input_file, int packed, int power_of_two, int record_starts)
+{
+    checkKeyCount(N, power_of_two);
+
+    strings = (char *)allocBuffer(N * LENGTH);
+    if (strings == NULL)
     {
-        bitonicSortParallel();
+        perror("malloc strings");
+        exit(EXIT_FAILURE);
     }
-    else if (strcmp(method, "mergesort") == 0)
+
+    if (record_starts)
     {
-        mergeSort();
+        record_start = (long int *)malloc(N * sizeof(long int));
+        if (record_start == NULL)
+        {
+            perror("malloc record offsets");
+            exit(EXIT_FAILURE);
+        }
     }
-    else if (strcmp(method, "mergesort_parallel") == 0)
+
+    keys = (uint64_t *)strings;
+    keys_packed = packed;
+
+    if (input_binary)
     {
-        mergeSortParallel();
+        const uint64_t *slots = (const uint64_t *)input_body;
+#pragma omp parallel for schedule(static)
+        for (long int i = 0; i < N; i++)
+            keys[i] = packed ? toBigEndian(slots[i]) : slots[i];
+        return;
     }
-    else
+
+    long int lines = parseLines(input_body, input_data + input_size, strings, N, packed, record_start);
+    if (lines < N)
     {
-        fprintf(stderr, "Unknown sorting method: %s\n", method);
+        fprintf(stderr, "Input file %s has %ld elements, expected %ld\n", input_file, lines, N);
         exit(EXIT_FAILURE);
     }
 }
 
-int main(int argc, char **argv)
-{
-    long int i;
-    char input_file[256] = INPUT_DIR DEFAULT_INPUT_FILE;
-    char sort_method[32] = "bitonic_parallel"; // Default sorting method
+/*
+ * Output writer.
+ *
+ * Each thread owns a contiguous range of entries. A first pass sums the line
+ * lengths of every range, a prefix sum turns them into file offsets, and each
+ * thread then formats its range into a private buffer and writes it with a few
+ * large pwrite calls. Packed keys are formatted directly, without converting
+ * the buffer back to strings. Other outputs (see argsort) plug in their own
+ * line length and formatting functions. The same pass can fill a memory
+ * buffer instead of the file, see formatOutput().
+ */
 
-    parseCommandLineArguments(argc, argv, input_file, sort_method);
+#define WRITE_BUFFER_BYTES (8 << 20)
+
+static inline int slotLength(long int i)
+{
+    if (keys_packed)
+        return keyLength(keys[i]);
+    return strnlen(strings + i * LENGTH, LENGTH);
+}
 
-    openfiles(input_file);
+static size_t slotLineLength(long int i)
+{
+    return slotLength(i) + 1;
+}
 
-    fscanf(fin, "%ld", &N);
-    if (N > 1073741824 || powersOfTwo[(int)log2(N)] != N)
+// Whole slots are copied, so formatters may write up to LENGTH bytes past the line.
+static size_t formatSlot(char *p, long int i)
+{
+    if (keys_packed)
     {
-        printf("%ld is not a valid number: must be a power of 2 and less than 1073741824!\n", N);
-        exit(EXIT_FAILURE);
+        uint64_t bytes = toBigEndian(keys[i]);
+        memcpy(p, &bytes, LENGTH);
     }
-
-    strings = (char *)calloc(N, LENGTH);
-    if (strings == NULL)
+    else
     {
-        perror("malloc strings");
-        exit(EXIT_FAILURE);
+        memcpy(p, strings + i * LENGTH, LENGTH);
     }
+    int len = slotLength(i);
+    p[len] = '\n';
+    return len + 1;
+}
 
-    for (i = 0; i < N; i++)
-        fscanf(fin, "%s", strings + (i * LENGTH));
+static void pwriteAll(int fd, const char *buf, size_t size, off_t offset)
+{
+    while (size > 0)
+    {
+        ssize_t written = pwrite(fd, buf, size, offset);
+        if (written < 0)
+        {
+            perror("pwrite output");
+            exit(EXIT_FAILURE);
+        }
+        buf += written;
+        size -= written;
+        offset += written;
+    }
+}
+
+// Copies a formatted run of lines to the output file, or to `dst` if given.
+static inline void flushEntries(char *dst, const char *buf, size_t size, off_t offset)
+{
+    if (dst != NULL)
+        memcpy(dst + offset, buf, size);
+    else
+        pwriteAll(fout, buf, size, offset);
+}
+
+// Writes `count` lines of at most `max_line` bytes to the output file, or into
+// `dst` if it is not NULL. Always inlined, so that the line functions of each
+// caller are inlined in its copy.
+static inline __attribute__((always_inline)) void writeEntries(long int count, size_t max_line,
+                                                               size_t (*lineLength)(long int i),
+                                                               size_t (*formatLine)(char *p, long int i),
+                                                               char *dst)
+{
+    int max_threads = omp_get_max_threads();
+    off_t *offsets = (off_t *)malloc((max_threads + 1) * sizeof(off_t));
+    if (offsets == NULL)
+    {
+        perror("malloc output offsets");
+        exit(EXIT_FAILURE);
+    }
+
+#pragma omp parallel
+    {
+        int tid = omp_get_thread_num();
+        int nthreads = omp_get_num_threads();
+        long int begin = count * tid / nthreads;
+        long int end = count * (tid + 1) / nthreads;
+
+        off_t bytes = 0;
+        for (long int i = begin; i < end; i++)
+            bytes += lineLength(i);
+        offsets[tid + 1] = bytes;
+#pragma omp barrier
+#pragma omp single
+        {
+            offsets[0] = 0;
+            for (int t = 1; t <= nthreads; t++)
+                offsets[t] += offsets[t - 1];
+            if (dst == NULL && !output_shared && ftruncate(fout, offsets[nthreads]) < 0)
+                perror("ftruncate output");
+        }
+
+        size_t capacity = max_line + LENGTH > WRITE_BUFFER_BYTES ? max_line + LENGTH : WRITE_BUFFER_BYTES;
+        char *buf = (char *)malloc(capacity);
+        if (buf == NULL)
+        {
+            perror("malloc output buffer");
+            exit(EXIT_FAILURE);
+        }
+        off_t offset = (dst != NULL ? 0 : output_offset) + offsets[tid];
+        size_t used = 0;
+        for (long int i = begin; i < end; i++)
+        {
+            if (capacity - used < max_line + LENGTH)
+            {
+                flushEntries(dst, buf, used, offset);
+                offset += used;
+                used = 0;
+            }
+            used += formatLine(buf + used, i);
+        }
+        flushEntries(dst, buf, used, offset);
+        free(buf);
+    }
+
+    free(offsets);
+}
+
+// Bytes writeOutput() writes as text.
+size_t outputSize(void)
+{
+    size_t size = 0;
+#pragma omp parallel for schedule(static) reduction(+ : size)
+    for (long int i = 0; i < N; i++)
+        size += slotLineLength(i);
+    return size;
+}
+
+// Writes the first `count` sorted slots of `keys` to fd as a binary container.
+static void writeContainer(int fd, long int count)
+{
+    size_t size = sizeof(BinaryHeader) + count * LENGTH;
+    if (ftruncate(fd, size) < 0)
+    {
+        perror("ftruncate output");
+        exit(EXIT_FAILURE);
+    }
+    char *out = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (out == MAP_FAILED)
+    {
+        perror("mmap output");
+        exit(EXIT_FAILURE);
+    }
+
+    BinaryHeader header = {BINARY_MAGIC, BINARY_VERSION, LENGTH, 1, 0, count};
+    memcpy(out, &header, sizeof(header));
+    uint64_t *slots = (uint64_t *)(out + sizeof(header));
+#pragma omp parallel for schedule(static)
+    for (long int i = 0; i < count; i++)
+        slots[i] = keys_packed ? toBigEndian(keys[i]) : keys[i];
+
+    munmap(out, size);
+}
+
+void writeBinaryOutput(long int count)
+{
+    writeContainer(fout, count);
+}
+
+// Writes the first `count` slots, as text or as a binary container.
+void writeKeys(long int count)
+{
+    if (output_binary)
+        writeBinaryOutput(count);
+    else
+        writeEntries(count, LENGTH + 1, slotLineLength, formatSlot, NULL);
+}
+
+void writeOutput(void)
+{
+    writeKeys(N);
+}
+
+// Formats the text writeOutput() would write into `buf`, which holds outputSize() bytes.
+void formatOutput(char *buf)
+{
+    writeEntries(N, LENGTH + 1, slotLineLength, formatSlot, buf);
+}
+
+/*
+ * Output validation ("-validate").
+ *
+ * Checks the sorted buffer before it is written, without reading any file
+ * back: adjacent slots must be in order, and an order-independent hash of the
+ * keys, the wrapping sum of a mix of every key, must equal the one taken right
+ * after loading, so the output is a permutation of the input. Each check is a
+ * single parallel pass over the buffer.
+ */
+
+// splitmix64 finalizer, so that sums of mixed keys rarely collide.
+static inline uint64_t mixKey(uint64_t v)
+{
+    v ^= v >> 30;
+    v *= 0xbf58476d1ce4e5b9ULL;
+    v ^= v >> 27;
+    v *= 0x94d049bb133111ebULL;
+    return v ^ (v >> 31);
+}
+
+// Slot i as a packed key, whichever form the buffer holds.
+static inline uint64_t packedKey(long int i)
+{
+    if (keys_packed)
+        return keys[i];
+    // Swapped strings leave stale bytes after their terminator, which are not part of the key.
+    int len = slotLength(i);
+    return len == 0 ? 0 : toBigEndian(keys[i]) & (~0ULL << (LENGTH - len) * 8);
+}
+
+uint64_t multisetHash(void)
+{
+    uint64_t hash = 0;
+#pragma omp parallel for schedule(static) reduction(+ : hash)
+    for (long int i = 0; i < N; i++)
+        hash += mixKey(packedKey(i));
+    return hash;
+}
+
+// Exits if the buffer is not sorted or not a permutation of the input hashed as `input_hash`.
+void validateOutput(uint64_t input_hash)
+{
+    long int unsorted = N;
+#pragma omp parallel for schedule(static) reduction(min : unsorted)
+    for (long int i = 1; i < N; i++)
+        if (packedKey(i - 1) > packedKey(i) && i < unsorted)
+            unsorted = i;
+    if (unsorted < N)
+    {
+        fprintf(stderr, "Validation failed: entries %ld and %ld are out of order\n", unsorted - 1, unsorted);
+        exit(EXIT_FAILURE);
+    }
+    if (multisetHash() != input_hash)
+    {
+        fprintf(stderr, "Validation failed: the output is not a permutation of the input\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+ * Sequential leaf sort.
+ *
+ * Below the task threshold the parallel recursions stop splitting and hand
+ * the whole range to an introsort: median-of-three quicksort, heapsort once
+ * the depth budget of 2 log2(n) is spent, and insertion sort for ranges of up
+ * to LEAF_INSERTION keys. It sorts 8-byte slots as integers: packed keys as
+ * they are, string slots after a byte swap to big-endian keys (which orders
+ * them like strcmp), swapped back afterwards. Descending leaves, for the
+ * bitonic recursions, are sorted ascending and reversed.
+ */
+
+#define LEAF_INSERTION 16
+
+// Max-heap sift, shared with the top-k selection. Returns the compares it made.
+static inline long int siftDown(uint64_t *heap, long int size, long int i)
+{
+    uint64_t key = heap[i];
+    long int compares = 0;
+    for (long int child = 2 * i + 1; child < size; child = 2 * i + 1)
+    {
+        compares += 2;
+        if (child + 1 < size && heap[child + 1] > heap[child])
+            child++;
+        if (heap[child] <= key)
+            break;
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = key;
+    return compares;
+}
+
+// The sorts below return how many compares they made, for -stats.
+static long int insertionSortKeys(uint64_t *a, long int n)
+{
+    long int compares = 0;
+    for (long int i = 1; i < n; i++)
+    {
+        uint64_t key = a[i];
+        long int j = i;
+        for (; j > 0 && a[j - 1] > key; j--)
+            a[j] = a[j - 1];
+        a[j] = key;
+        compares += i - j + (j > 0);
+    }
+    return compares;
+}
+
+static long int introSortKeys(uint64_t *a, long int n, int depth)
+{
+    long int compares = 0;
+    while (n > LEAF_INSERTION)
+    {
+        if (depth-- == 0)
+        {
+            for (long int i = n / 2 - 1; i >= 0; i--)
+                compares += siftDown(a, n, i);
+            for (long int end = n - 1; end > 0; end--)
+            {
+                uint64_t top = a[0];
+                a[0] = a[end];
+                a[end] = top;
+                compares += siftDown(a, end, 0);
+            }
+            return compares;
+        }
+
+        uint64_t x = a[0], y = a[n / 2], z = a[n - 1];
+        uint64_t pivot = x < y ? (y < z ? y : (x < z ? z : x)) : (x < z ? x : (y < z ? z : y));
+        long int i = -1, j = n;
+        for (;;)
+        {
+            do
+                i++;
+            while (a[i] < pivot);
+            do
+                j--;
+            while (a[j] > pivot);
+            if (i >= j)
+                break;
+            uint64_t t = a[i];
+            a[i] = a[j];
+            a[j] = t;
+        }
+        compares += 3 + (i + 1) + (n - j); // Median of three, then one compare per scan step
+
+        // Recurse into the smaller side, loop on the larger one
+        if (j + 1 < n - j - 1)
+        {
+            compares += introSortKeys(a, j + 1, depth);
+            a += j + 1;
+            n -= j + 1;
+        }
+        else
+        {
+            compares += introSortKeys(a + j + 1, n - j - 1, depth);
+            n = j + 1;
+        }
+    }
+    return compares + insertionSortKeys(a, n);
+}
+
+void sortLeaf(uint64_t *a, long int n, int dir, int string_slots)
+{
+    if (string_slots)
+        for (long int i = 0; i < n; i++)
+            a[i] = toBigEndian(a[i]);
+    long int leaf_compares = introSortKeys(a, n, 2 * (int)log2(n > 1 ? n : 2));
+    STATS_ADD(compares, leaf_compares);
+    if (dir == DESCENDING)
+    {
+        for (long int i = 0, j = n - 1; i < j; i++, j--)
+        {
+            uint64_t t = a[i];
+            a[i] = a[j];
+            a[j] = t;
+        }
+    }
+    if (string_slots)
+        for (long int i = 0; i < n; i++)
+            a[i] = toBigEndian(a[i]);
+}
+
+void compare(int i, int j, int dir)
+{
+    STATS_ADD(compares, 1);
+    if (dir == (strcmp(strings + i * LENGTH, strings + j * LENGTH) > 0))
+    {
+        STATS_ADD(swaps, 1);
+        char t[LENGTH];
+        strcpy(t, strings + i * LENGTH);
+        strcpy(strings + i * LENGTH, strings + j * LENGTH);
+        strcpy(strings + j * LENGTH, t);
+    }
+}
+
+void bitonicMerge(int lo, int cnt, int dir)
+{
+    if (cnt > 1)
+    {
+        int k = cnt / 2;
+        int i;
+        for (i = lo; i < lo + k; i++)
+            compare(i, i + k, dir);
+        bitonicMerge(lo, k, dir);
+        bitonicMerge(lo + k, k, dir);
+    }
+}
+
+void bitonicMergeParallel(int lo, int cnt, int dir)
+{
+    if (cnt > 1)
+    {
+        int k = cnt / 2;
+        double start = STATS_TIMER_START();
+        // #pragma omp parallel for // this makes it slower
+        for (int i = lo; i < lo + k; i++)
+        {
+            compare(i, i + k, dir);
+        }
+        STATS_TIMER_STOP(start);
+
+        STATS_ADD(tasks_spawned, 1);
+#pragma omp task firstprivate(lo, k) if (cnt > task_threshold)
+        {
+            STATS_ADD(tasks_executed, 1);
+            bitonicMergeParallel(lo, k, dir);
+        }
+        STATS_ADD(tasks_spawned, 1);
+#pragma omp task firstprivate(lo, k) if (cnt > task_threshold)
+        {
+            STATS_ADD(tasks_executed, 1);
+            bitonicMergeParallel(lo + k, k, dir);
+        }
+#pragma omp taskwait
+    }
+}
+
+void recBitonicSort(int lo, int cnt, int dir)
+{
+    if (cnt > 1)
+    {
+        int k = cnt / 2;
+        recBitonicSort(lo, k, ASCENDING);
+        recBitonicSort(lo + k, k, DESCENDING);
+        double start = STATS_TIMER_START();
+        bitonicMerge(lo, cnt, dir);
+        STATS_TIMER_STOP(start);
+    }
+}
+
+void recBitonicSortParallel(int lo, int cnt, int dir)
+{
+    if (cnt <= task_threshold)
+    {
+        sortLeaf((uint64_t *)(strings + lo * LENGTH), cnt, dir, 1);
+    }
+    else if (cnt > 1)
+    {
+        int k = cnt / 2;
+        STATS_ADD(tasks_spawned, 1);
+#pragma omp task firstprivate(lo, k) if (cnt > task_threshold)
+        {
+            STATS_ADD(tasks_executed, 1);
+            recBitonicSortParallel(lo, k, ASCENDING);
+        }
+        STATS_ADD(tasks_spawned, 1);
+#pragma omp task firstprivate(lo, k) if (cnt > task_threshold)
+        {
+            STATS_ADD(tasks_executed, 1);
+            recBitonicSortParallel(lo + k, k, DESCENDING);
+        }
+#pragma omp taskwait
+        bitonicMergeParallel(lo, cnt, dir);
+    }
+}
+
+void bitonicSort()
+{
+    recBitonicSort(0, N, ASCENDING);
+}
+
+void bitonicSortParallel()
+{
+#pragma omp parallel
+    {
+#pragma omp single
+        {
+            recBitonicSortParallel(0, N, ASCENDING);
+        }
+    }
+}
+
+/*
+ * Mergesort ping-pongs between `strings` and one auxiliary buffer of N slots.
+ * Both start with the same contents; each recursion level sorts its halves
+ * into the other buffer and merges them back, so there is no allocation or
+ * copy-back per merge.
+ */
+
+// Merges src[i, iend) and src[j, jend) into dst starting at k.
+void mergeRuns(const char *src, char *dst, int i, int iend, int j, int jend, int k)
+{
+    double start = STATS_TIMER_START();
+    int first = k;
+    while (i < iend && j < jend)
+    {
+        if (strcmp(src + i * LENGTH, src + j * LENGTH) <= 0)
+        {
+            memcpy(dst + k * LENGTH, src + i * LENGTH, LENGTH);
+            i++;
+        }
+        else
+        {
+            memcpy(dst + k * LENGTH, src + j * LENGTH, LENGTH);
+            j++;
+        }
+        k++;
+    }
+    STATS_ADD(compares, k - first);
+    memcpy(dst + k * LENGTH, src + i * LENGTH, (iend - i) * LENGTH);
+    k += iend - i;
+    memcpy(dst + k * LENGTH, src + j * LENGTH, (jend - j) * LENGTH);
+    STATS_TIMER_STOP(start);
+}
+
+void merge(const char *src, char *dst, int low, int mid, int high)
+{
+    mergeRuns(src, dst, low, mid, mid, high, low);
+}
+
+/*
+ * Merge path: the first k outputs of merging A = [low, mid) and B = [mid, high)
+ * take some i elements from A and k - i from B. That co-rank is found by binary
+ * search, so the output can be cut into equal segments that are merged as
+ * independent tasks with the sequential merge.
+ */
+
+int coRank(const char *src, int k, int low, int mid, int high)
+{
+    int n1 = mid - low, n2 = high - mid;
+    int lo = k > n2 ? k - n2 : 0;
+    int hi = k < n1 ? k : n1;
+    while (lo < hi)
+    {
+        int i = lo + (hi - lo) / 2;
+        int j = k - i;
+        if (strcmp(src + (mid + j - 1) * LENGTH, src + (low + i) * LENGTH) < 0)
+            hi = i;
+        else
+            lo = i + 1;
+    }
+    return lo;
+}
+
+void mergeParallel(const char *src, char *dst, int low, int mid, int high)
+{
+    int n = high - low;
+    int segments = omp_get_num_threads() * 4;
+    if (task_threshold > 0 && segments > n / task_threshold)
+        segments = n / task_threshold;
+    if (segments < 2)
+    {
+        merge(src, dst, low, mid, high);
+        return;
+    }
+    for (int seg = 0; seg < segments; seg++)
+    {
+        STATS_ADD(tasks_spawned, 1);
+#pragma omp task firstprivate(seg)
+        {
+            STATS_ADD(tasks_executed, 1);
+            int k0 = (int)((long int)n * seg / segments);
+            int k1 = (int)((long int)n * (seg + 1) / segments);
+            int i0 = coRank(src, k0, low, mid, high);
+            int i1 = coRank(src, k1, low, mid, high);
+            mergeRuns(src, dst, low + i0, low + i1, mid + k0 - i0, mid + k1 - i1, low + k0);
+        }
+    }
+#pragma omp taskwait
+}
+
+/*
+ * Socket-aware split for -numa: every node sorts the slice of the buffers it
+ * owns with its own nested team, and the sorted slices are then merged
+ * pairwise by the whole team. Slices are sorted into whichever buffer makes
+ * the last merge round end in `dst`; both buffers hold the input on entry.
+ */
+
+void mergeSortNuma(void *src, void *dst, size_t width, void (*sortRange)(void *, void *, int, int),
+                   void (*mergeRange)(const void *, void *, int, int, int))
+{
+    int nodes = numaNodeCount();
+    int threads = omp_get_max_threads();
+    if (nodes > threads)
+        nodes = threads;
+    int *bound = (int *)malloc((nodes + 1) * sizeof(int));
+    if (bound == NULL)
+    {
+        perror("malloc numa slices");
+        exit(EXIT_FAILURE);
+    }
+    for (int node = 0; node <= nodes; node++)
+        bound[node] = (int)(N * node / nodes);
+
+    int rounds = 0;
+    while ((1 << rounds) < nodes)
+        rounds++;
+    char *from = (char *)(rounds % 2 == 0 ? dst : src);
+    char *to = (char *)(rounds % 2 == 0 ? src : dst);
+
+    omp_set_max_active_levels(2);
+#pragma omp parallel num_threads(nodes) proc_bind(spread)
+    {
+        int node = omp_get_thread_num();
+        int team = threads * (node + 1) / nodes - threads * node / nodes;
+#pragma omp parallel num_threads(team) proc_bind(close)
+        {
+#pragma omp single
+            {
+                sortRange(to, from, bound[node], bound[node + 1]);
+            }
+        }
+    }
+
+    for (int span = 1; span < nodes; span *= 2)
+    {
+#pragma omp parallel
+        {
+#pragma omp single
+            {
+                for (int node = 0; node < nodes; node += 2 * span)
+                {
+                    int low = bound[node];
+                    int mid = bound[node + span < nodes ? node + span : nodes];
+                    int high = bound[node + 2 * span < nodes ? node + 2 * span : nodes];
+                    if (mid < high)
+                        mergeRange(from, to, low, mid, high);
+                    else
+                        memcpy(to + (size_t)low * width, from + (size_t)low * width, (size_t)(high - low) * width);
+                }
+            }
+        }
+        char *swap = from;
+        from = to;
+        to = swap;
+    }
+    free(bound);
+}
+
+// Sorts [low, high) of `src` into `dst`, using `src` as scratch space.
+void recMergeSort(char *src, char *dst, int low, int high)
+{
+    if (high - low < 2)
+    {
+        memcpy(dst + low * LENGTH, src + low * LENGTH, (high - low) * LENGTH);
+        return;
+    }
+    int mid = (low + high) / 2;
+    recMergeSort(dst, src, low, mid);
+    recMergeSort(dst, src, mid, high);
+    merge(src, dst, low, mid, high);
+}
+
+// Both buffers hold the input range on entry, so leaves sort `dst` in place.
+void recMergeSortParallel(char *src, char *dst, int low, int high)
+{
+    if (high - low <= task_threshold || high - low < 2)
+    {
+        sortLeaf((uint64_t *)(dst + low * LENGTH), high - low, ASCENDING, 1);
+        return;
+    }
+    int mid = (low + high) / 2;
+    STATS_ADD(tasks_spawned, 1);
+#pragma omp task firstprivate(low, mid) if ((high - low) > task_threshold)
+    {
+        STATS_ADD(tasks_executed, 1);
+        recMergeSortParallel(dst, src, low, mid);
+    }
+    STATS_ADD(tasks_spawned, 1);
+#pragma omp task firstprivate(mid, high) if ((high - low) > task_threshold)
+    {
+        STATS_ADD(tasks_executed, 1);
+        recMergeSortParallel(dst, src, mid, high);
+    }
+#pragma omp taskwait
+    mergeParallel(src, dst, low, mid, high);
+}
+
+char *allocMergeBuffer(size_t size)
+{
+    char *aux = (char *)allocBuffer(N * size);
+    if (aux == NULL)
+    {
+        perror("malloc merge buffer");
+        exit(EXIT_FAILURE);
+    }
+#pragma omp parallel for schedule(static)
+    for (long int i = 0; i < N; i++)
+        memcpy(aux + i * size, strings + i * size, size);
+    return aux;
+}
+
+void mergeSort()
+{
+    char *aux = allocMergeBuffer(LENGTH);
+    recMergeSort(aux, strings, 0, N);
+    freeBuffer(aux, N * LENGTH);
+}
+
+static void sortRangeStrings(void *src, void *dst, int low, int high)
+{
+    recMergeSortParallel((char *)src, (char *)dst, low, high);
+}
+
+static void mergeRangeStrings(const void *src, void *dst, int low, int mid, int high)
+{
+    mergeParallel((const char *)src, (char *)dst, low, mid, high);
+}
+
+void mergeSortParallel()
+{
+    char *aux = allocMergeBuffer(LENGTH);
+    if (numa_mode && numaNodeCount() > 1)
+    {
+        mergeSortNuma(aux, strings, LENGTH, sortRangeStrings, mergeRangeStrings);
+    }
+    else
+    {
+#pragma omp parallel
+        {
+#pragma omp single
+            {
+                recMergeSortParallel(aux, strings, 0, N);
+            }
+        }
+    }
+    freeBuffer(aux, N * LENGTH);
+}
+
+/*
+ * Packed key variants.
+ *
+ * Each LENGTH-byte slot is reinterpreted in place as a big-endian uint64_t, so
+ * that comparing two keys as integers gives the same order as strcmp on the
+ * zero-padded slots. Compare-exchanges become min/max moves and merges become
+ * branch-free selects instead of strcmp/strcpy calls.
+ */
+
+void packKeys(void)
+{
+    if (!keys_packed)
+    {
+#pragma omp parallel for schedule(static)
+        for (long int i = 0; i < N; i++)
+            keys[i] = toBigEndian(keys[i]);
+    }
+    keys_packed = 1;
+}
+
+// Compare-exchanges keys[lo + i] with keys[lo + stride + i] for i < count.
+static inline void compareKeysStrided(long int lo, long int stride, long int count, int dir)
+{
+    STATS_ADD(compares, count);
+    uint64_t *a = keys + lo;
+    uint64_t *b = keys + lo + stride;
+    for (long int i = 0; i < count; i++)
+    {
+        uint64_t x = a[i], y = b[i];
+        uint64_t min = x < y ? x : y;
+        uint64_t max = x < y ? y : x;
+        a[i] = dir ? min : max;
+        b[i] = dir ? max : min;
+    }
+}
+
+static inline void compareKeysRange(int lo, int k, int dir)
+{
+    compareKeysStrided(lo, k, k, dir);
+}
+
+void bitonicMergeKeys(int lo, int cnt, int dir)
+{
+    if (cnt > 1)
+    {
+        int k = cnt / 2;
+        compareKeysRange(lo, k, dir);
+        bitonicMergeKeys(lo, k, dir);
+        bitonicMergeKeys(lo + k, k, dir);
+    }
+}
+
+void recBitonicSortKeys(int lo, int cnt, int dir);
+
+/*
+ * Leaf kernels for the packed bitonic_parallel recursion.
+ *
+ * Blocks of up to SIMD_BLOCK keys are loaded into a local array of vector
+ * registers and sorted (or merged, when already bitonic) with the iterative
+ * min/max bitonic network. Strides of at least one register are exchanges
+ * between registers; the smaller strides are lane permutes plus blends.
+ * There is no unsigned 64-bit compare before AVX-512, so keys are biased by
+ * the sign bit while they live in registers and signed compares are used.
+ * The kernel is picked once at startup from the CPU features.
+ */
+
+#define SIMD_BLOCK 32
+
+// Compare-exchanges of stages kmin .. cnt of the network over cnt keys, as the scalar kernels count them.
+static inline long int bitonicNetworkCompares(int cnt, int kmin)
+{
+    long int compares = 0;
+    for (int k = kmin; k <= cnt; k *= 2)
+        compares += (long int)(cnt / 2) * __builtin_ctz(k);
+    return compares;
+}
+
+void sortBlockKeysScalar(int lo, int cnt, int dir)
+{
+    recBitonicSortKeys(lo, cnt, dir);
+}
+
+void mergeBlockKeysScalar(int lo, int cnt, int dir)
+{
+    bitonicMergeKeys(lo, cnt, dir);
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("avx2"))) static void bitonicStageAVX2(__m256i *v, int nregs, int k, int dir)
+{
+    for (int j = k / 2; j >= 4; j /= 2)
+    {
+        int jr = j / 4;
+        for (int r = 0; r < nregs; r++)
+        {
+            if (r & jr)
+                continue;
+            int asc = (((r * 4) & k) == 0) == dir;
+            __m256i gt = _mm256_cmpgt_epi64(v[r], v[r + jr]);
+            __m256i mn = _mm256_blendv_epi8(v[r], v[r + jr], gt);
+            __m256i mx = _mm256_blendv_epi8(v[r + jr], v[r], gt);
+            v[r] = asc ? mn : mx;
+            v[r + jr] = asc ? mx : mn;
+        }
+    }
+    for (int r = 0; r < nregs; r++)
+    {
+        int asc = (((r * 4) & k) == 0) == dir;
+        if (k >= 4)
+        {
+            // Stride 2: exchange the two 128-bit halves.
+            __m256i w = _mm256_permute4x64_epi64(v[r], 0x4E);
+            __m256i gt = _mm256_cmpgt_epi64(v[r], w);
+            __m256i mn = _mm256_blendv_epi8(v[r], w, gt);
+            __m256i mx = _mm256_blendv_epi8(w, v[r], gt);
+            v[r] = asc ? _mm256_blend_epi32(mn, mx, 0xF0) : _mm256_blend_epi32(mx, mn, 0xF0);
+        }
+        // Stride 1: exchange neighbouring lanes.
+        __m256i w = _mm256_permute4x64_epi64(v[r], 0xB1);
+        __m256i gt = _mm256_cmpgt_epi64(v[r], w);
+        __m256i mn = _mm256_blendv_epi8(v[r], w, gt);
+        __m256i mx = _mm256_blendv_epi8(w, v[r], gt);
+        if (k == 2) // Pairs alternate direction inside the register.
+            v[r] = dir ? _mm256_blend_epi32(mn, mx, 0x3C) : _mm256_blend_epi32(mx, mn, 0x3C);
+        else
+            v[r] = asc ? _mm256_blend_epi32(mn, mx, 0xCC) : _mm256_blend_epi32(mx, mn, 0xCC);
+    }
+}
+
+__attribute__((target("avx2"))) static void bitonicBlockAVX2(int lo, int cnt, int dir, int kmin)
+{
+    __m256i v[SIMD_BLOCK / 4];
+    __m256i bias = _mm256_set1_epi64x((long long)0x8000000000000000ULL);
+    int nregs = cnt / 4;
+    STATS_ADD(compares, bitonicNetworkCompares(cnt, kmin));
+    for (int r = 0; r < nregs; r++)
+        v[r] = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(keys + lo + r * 4)), bias);
+    for (int k = kmin; k <= cnt; k *= 2)
+        bitonicStageAVX2(v, nregs, k, dir);
+    for (int r = 0; r < nregs; r++)
+        _mm256_storeu_si256((__m256i *)(keys + lo + r * 4), _mm256_xor_si256(v[r], bias));
+}
+
+__attribute__((target("avx2"))) void sortBlockKeysAVX2(int lo, int cnt, int dir)
+{
+    if (cnt < 4)
+        sortBlockKeysScalar(lo, cnt, dir);
+    else
+        bitonicBlockAVX2(lo, cnt, dir, 2);
+}
+
+__attribute__((target("avx2"))) void mergeBlockKeysAVX2(int lo, int cnt, int dir)
+{
+    if (cnt < 4)
+        mergeBlockKeysScalar(lo, cnt, dir);
+    else
+        bitonicBlockAVX2(lo, cnt, dir, cnt);
+}
+
+__attribute__((target("sse4.2"))) static void bitonicStageSSE42(__m128i *v, int nregs, int k, int dir)
+{
+    for (int j = k / 2; j >= 2; j /= 2)
+    {
+        int jr = j / 2;
+        for (int r = 0; r < nregs; r++)
+        {
+            if (r & jr)
+                continue;
+            int asc = (((r * 2) & k) == 0) == dir;
+            __m128i gt = _mm_cmpgt_epi64(v[r], v[r + jr]);
+            __m128i mn = _mm_blendv_epi8(v[r], v[r + jr], gt);
+            __m128i mx = _mm_blendv_epi8(v[r + jr], v[r], gt);
+            v[r] = asc ? mn : mx;
+            v[r + jr] = asc ? mx : mn;
+        }
+    }
+    for (int r = 0; r < nregs; r++)
+    {
+        // Stride 1: exchange the two lanes.
+        int asc = (((r * 2) & k) == 0) == dir;
+        __m128i w = _mm_shuffle_epi32(v[r], 0x4E);
+        __m128i gt = _mm_cmpgt_epi64(v[r], w);
+        __m128i mn = _mm_blendv_epi8(v[r], w, gt);
+        __m128i mx = _mm_blendv_epi8(w, v[r], gt);
+        v[r] = asc ? _mm_blend_epi16(mn, mx, 0xF0) : _mm_blend_epi16(mx, mn, 0xF0);
+    }
+}
+
+__attribute__((target("sse4.2"))) static void bitonicBlockSSE42(int lo, int cnt, int dir, int kmin)
+{
+    __m128i v[SIMD_BLOCK / 2];
+    __m128i bias = _mm_set1_epi64x((long long)0x8000000000000000ULL);
+    int nregs = cnt / 2;
+    STATS_ADD(compares, bitonicNetworkCompares(cnt, kmin));
+    for (int r = 0; r < nregs; r++)
+        v[r] = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(keys + lo + r * 2)), bias);
+    for (int k = kmin; k <= cnt; k *= 2)
+        bitonicStageSSE42(v, nregs, k, dir);
+    for (int r = 0; r < nregs; r++)
+        _mm_storeu_si128((__m128i *)(keys + lo + r * 2), _mm_xor_si128(v[r], bias));
+}
+
+__attribute__((target("sse4.2"))) void sortBlockKeysSSE42(int lo, int cnt, int dir)
+{
+    if (cnt < 2)
+        return;
+    bitonicBlockSSE42(lo, cnt, dir, 2);
+}
+
+__attribute__((target("sse4.2"))) void mergeBlockKeysSSE42(int lo, int cnt, int dir)
+{
+    if (cnt < 2)
+        return;
+    bitonicBlockSSE42(lo, cnt, dir, cnt);
+}
+#endif
+
+void (*sortBlockKeys)(int lo, int cnt, int dir) = sortBlockKeysScalar;
+void (*mergeBlockKeys)(int lo, int cnt, int dir) = mergeBlockKeysScalar;
+
+void initSimdKernels(void)
+{
+    int auto_mode = strcmp(simd_kernel, "auto") == 0;
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if ((auto_mode || strcmp(simd_kernel, "avx2") == 0) && __builtin_cpu_supports("avx2"))
+    {
+        sortBlockKeys = sortBlockKeysAVX2;
+        mergeBlockKeys = mergeBlockKeysAVX2;
+        return;
+    }
+    if ((auto_mode || strcmp(simd_kernel, "sse4.2") == 0) && __builtin_cpu_supports("sse4.2"))
+    {
+        sortBlockKeys = sortBlockKeysSSE42;
+        mergeBlockKeys = mergeBlockKeysSSE42;
+        return;
+    }
+#endif
+    if (!auto_mode && strcmp(simd_kernel, "scalar") != 0)
+        fprintf(stderr, "SIMD kernel %s is not available, using scalar\n", simd_kernel);
+    sortBlockKeys = sortBlockKeysScalar;
+    mergeBlockKeys = mergeBlockKeysScalar;
+}
+
+void bitonicMergeKeysParallel(int lo, int cnt, int dir)
+{
+    if (cnt <= SIMD_BLOCK)
+    {
+        double start = STATS_TIMER_START();
+        mergeBlockKeys(lo, cnt, dir);
+        STATS_TIMER_STOP(start);
+    }
+    else
+    {
+        int k = cnt / 2;
+        double start = STATS_TIMER_START();
+        compareKeysRange(lo, k, dir);
+        STATS_TIMER_STOP(start);
+
+        STATS_ADD(tasks_spawned, 1);
+#pragma omp task firstprivate(lo, k) if (cnt > task_threshold)
+        {
+            STATS_ADD(tasks_executed, 1);
+            bitonicMergeKeysParallel(lo, k, dir);
+        }
+        STATS_ADD(tasks_spawned, 1);
+#pragma omp task firstprivate(lo, k) if (cnt > task_threshold)
+        {
+            STATS_ADD(tasks_executed, 1);
+            bitonicMergeKeysParallel(lo + k, k, dir);
+        }
+#pragma omp taskwait
+    }
+}
+
+void recBitonicSortKeys(int lo, int cnt, int dir)
+{
+    if (cnt > 1)
+    {
+        int k = cnt / 2;
+        recBitonicSortKeys(lo, k, ASCENDING);
+        recBitonicSortKeys(lo + k, k, DESCENDING);
+        // Merges inside a leaf block are not timed, as with the SIMD kernels.
+        double start = cnt > SIMD_BLOCK ? STATS_TIMER_START() : 0.0;
+        bitonicMergeKeys(lo, cnt, dir);
+        if (cnt > SIMD_BLOCK)
+            STATS_TIMER_STOP(start);
+    }
+}
+
+void recBitonicSortKeysParallel(int lo, int cnt, int dir)
+{
+    if (cnt <= SIMD_BLOCK)
+    {
+        sortBlockKeys(lo, cnt, dir);
+    }
+    else if (cnt <= task_threshold)
+    {
+        sortLeaf(keys + lo, cnt, dir, 0);
+    }
+    else
+    {
+        int k = cnt / 2;
+        STATS_ADD(tasks_spawned, 1);
+#pragma omp task firstprivate(lo, k) if (cnt > task_threshold)
+        {
+            STATS_ADD(tasks_executed, 1);
+            recBitonicSortKeysParallel(lo, k, ASCENDING);
+        }
+        STATS_ADD(tasks_spawned, 1);
+#pragma omp task firstprivate(lo, k) if (cnt > task_threshold)
+        {
+            STATS_ADD(tasks_executed, 1);
+            recBitonicSortKeysParallel(lo + k, k, DESCENDING);
+        }
+#pragma omp taskwait
+        bitonicMergeKeysParallel(lo, cnt, dir);
+    }
+}
+
+void bitonicSortKeys()
+{
+    recBitonicSortKeys(0, N, ASCENDING);
+}
+
+void bitonicSortKeysParallel()
+{
+#pragma omp parallel
+    {
+#pragma omp single
+        {
+            recBitonicSortKeysParallel(0, N, ASCENDING);
+        }
+    }
+}
+
+/*
+ * Cache-blocked iterative bitonic sort.
+ *
+ * Stage k of the iterative network compare-exchanges i with i ^ j for every
+ * stride j = k/2 .. 1, ascending where (i & k) == 0. Every stride below
+ * BITONIC_BLOCK stays inside one block, so all of those are run back to back
+ * on a block while it is resident in L2, ending with the SIMD leaf kernels.
+ * Only the strides of at least one block stream through memory, each as one
+ * parallel pass split into block-sized runs of contiguous pairs.
+ */
+
+#define BITONIC_BLOCK (1 << 15) // 256 KiB of keys
+
+// Applies strides j .. 1 of stage k to [lo, lo + cnt), ending with the leaf kernel.
+static void bitonicStridesKeys(long int lo, long int cnt, long int j, long int k)
+{
+    double start = STATS_TIMER_START();
+    for (; j >= SIMD_BLOCK; j /= 2)
+        for (long int s = lo; s < lo + cnt; s += 2 * j)
+            compareKeysRange(s, j, (s & k) == 0);
+    for (long int s = lo; s < lo + cnt; s += SIMD_BLOCK)
+        mergeBlockKeys(s, SIMD_BLOCK, (s & k) == 0);
+    STATS_TIMER_STOP(start);
+}
+
+// A timed cross-block sweep of bitonic_blocked and bitonic_dataflow.
+static void bitonicExchangeKeys(long int i, long int j, long int count, int dir)
+{
+    double start = STATS_TIMER_START();
+    compareKeysStrided(i, j, count, dir);
+    STATS_TIMER_STOP(start);
+}
+
+void bitonicSortBlocked()
+{
+    if (N <= SIMD_BLOCK)
+    {
+        sortBlockKeys(0, N, ASCENDING);
+        return;
+    }
+    long int block = N < BITONIC_BLOCK ? N : BITONIC_BLOCK;
+
+#pragma omp parallel
+    {
+        // Every stage whose runs fit in a block.
+#pragma omp for schedule(static)
+        for (long int b = 0; b < N; b += block)
+        {
+            for (long int s = b; s < b + block; s += SIMD_BLOCK)
+                sortBlockKeys(s, SIMD_BLOCK, (s & SIMD_BLOCK) == 0);
+            for (long int k = 2 * SIMD_BLOCK; k <= block; k *= 2)
+                bitonicStridesKeys(b, block, k / 2, k);
+        }
+
+        for (long int k = 2 * block; k <= N; k *= 2)
+        {
+            for (long int j = k / 2; j >= block; j /= 2)
+            {
+#pragma omp for schedule(static)
+                for (long int c = 0; c < N / 2; c += block)
+                {
+                    long int i = ((c & ~(j - 1)) << 1) | (c & (j - 1));
+                    bitonicExchangeKeys(i, j, block, (i & k) == 0);
+                }
+            }
+#pragma omp for schedule(static)
+            for (long int b = 0; b < N; b += block)
+                bitonicStridesKeys(b, block, block / 2, k);
+        }
+    }
+}
+
+/*
+ * Statically scheduled bitonic sort ("-sort bitonic_static").
+ *
+ * Each of a power-of-two number of threads owns one contiguous slice and
+ * sorts it locally. The cross-slice stages are exchanges between partner
+ * threads: each thread reads its partner's slice but only writes its own
+ * slice of the other buffer, keeping the minima or maxima, so there is no
+ * task creation and every thread keeps writing the memory it first touched.
+ * Stages are separated by barriers. The strides within a slice then run in
+ * place on whichever buffer holds the data, which `keys` points at.
+ */
+
+void bitonicSortStatic()
+{
+    uint64_t *original = keys;
+    uint64_t *aux = (uint64_t *)malloc(N * sizeof(uint64_t)); // Pages are first touched by their owners
+    if (aux == NULL)
+    {
+        perror("malloc bitonic buffer");
+        exit(EXIT_FAILURE);
+    }
+
+#pragma omp parallel
+    {
+        long int slices = 1;
+        while (slices * 2 <= omp_get_num_threads() && N / (slices * 2) >= SIMD_BLOCK)
+            slices *= 2;
+        long int slice = N / slices;
+        long int t = omp_get_thread_num();
+        long int lo = t * slice;
+        uint64_t *buf[2] = {original, aux};
+        int cur = 0;
+
+        if (t < slices)
+            sortLeaf(keys + lo, slice, (lo & slice) == 0, 0);
+#pragma omp barrier
+
+        for (long int k = 2 * slice; k <= N; k *= 2)
+        {
+            for (long int j = k / 2; j >= slice; j /= 2)
+            {
+                if (t < slices)
+                {
+                    double start = STATS_TIMER_START();
+                    STATS_ADD(compares, slice / 2); // Each thread of the pair computes half of the outputs
+                    long int partner = lo ^ j;
+                    int dir = ((lo < partner ? lo : partner) & k) == 0;
+                    int keep_min = (lo < partner) == dir;
+                    const uint64_t *a = buf[cur] + lo, *b = buf[cur] + partner;
+                    uint64_t *out = buf[cur ^ 1] + lo;
+                    for (long int i = 0; i < slice; i++)
+                    {
+                        uint64_t x = a[i], y = b[i];
+                        uint64_t min = x < y ? x : y;
+                        uint64_t max = x < y ? y : x;
+                        out[i] = keep_min ? min : max;
+                    }
+                    STATS_TIMER_STOP(start);
+                }
+                cur ^= 1;
+#pragma omp barrier
+            }
+#pragma omp single
+            keys = buf[cur];
+            if (t < slices)
+                bitonicStridesKeys(lo, slice, slice / 2, k);
+#pragma omp barrier
+        }
+
+        if (cur == 1 && t < slices)
+            memcpy(original + lo, aux + lo, slice * sizeof(uint64_t));
+    }
+
+    keys = original;
+    free(aux);
+}
+
+/*
+ * Dataflow bitonic sort ("-sort bitonic_dataflow").
+ *
+ * The network of bitonic_blocked, with each block-sized piece of work as a
+ * task whose depend clauses name the blocks it reads and writes, represented
+ * by their first key. One thread creates the whole graph up front, so an
+ * exchange between two blocks starts as soon as the previous sweeps over both
+ * blocks are done, rather than at a taskwait for the whole level. The block
+ * size is the task threshold rounded down to a power of two.
+ */
+
+void bitonicSortDataflow()
+{
+    if (N <= SIMD_BLOCK)
+    {
+        sortBlockKeys(0, N, ASCENDING);
+        return;
+    }
+    long int block = SIMD_BLOCK;
+    while (block * 2 <= task_threshold && block * 2 <= N)
+        block *= 2;
+
+#pragma omp parallel
+    {
+#pragma omp single
+        {
+            for (long int b = 0; b < N; b += block)
+            {
+                STATS_ADD(tasks_spawned, 1);
+#pragma omp task firstprivate(b) depend(inout : keys[b])
+                {
+                    STATS_ADD(tasks_executed, 1);
+                    for (long int s = b; s < b + block; s += SIMD_BLOCK)
+                        sortBlockKeys(s, SIMD_BLOCK, (s & SIMD_BLOCK) == 0);
+                    for (long int k = 2 * SIMD_BLOCK; k <= block; k *= 2)
+                        bitonicStridesKeys(b, block, k / 2, k);
+                }
+            }
+
+            for (long int k = 2 * block; k <= N; k *= 2)
+            {
+                for (long int j = k / 2; j >= block; j /= 2)
+                {
+                    for (long int c = 0; c < N / 2; c += block)
+                    {
+                        long int i = ((c & ~(j - 1)) << 1) | (c & (j - 1));
+                        STATS_ADD(tasks_spawned, 1);
+#pragma omp task firstprivate(i, j, k) depend(inout : keys[i], keys[i + j])
+                        {
+                            STATS_ADD(tasks_executed, 1);
+                            bitonicExchangeKeys(i, j, block, (i & k) == 0);
+                        }
+                    }
+                }
+                for (long int b = 0; b < N; b += block)
+                {
+                    STATS_ADD(tasks_spawned, 1);
+#pragma omp task firstprivate(b, k) depend(inout : keys[b])
+                    {
+                        STATS_ADD(tasks_executed, 1);
+                        bitonicStridesKeys(b, block, block / 2, k);
+                    }
+                }
+            }
+        }
+    }
+}
+
+void mergeRunsKeys(const uint64_t *src, uint64_t *dst, int i, int iend, int j, int jend, int k)
+{
+    double start = STATS_TIMER_START();
+    int first = k;
+    while (i < iend && j < jend)
+    {
+        uint64_t a = src[i], b = src[j];
+        int takeLeft = a <= b;
+        dst[k++] = takeLeft ? a : b;
+        i += takeLeft;
+        j += !takeLeft;
+    }
+    STATS_ADD(compares, k - first);
+    while (i < iend)
+        dst[k++] = src[i++];
+    while (j < jend)
+        dst[k++] = src[j++];
+    STATS_TIMER_STOP(start);
+}
+
+void mergeKeys(const uint64_t *src, uint64_t *dst, int low, int mid, int high)
+{
+    mergeRunsKeys(src, dst, low, mid, mid, high, low);
+}
+
+int coRankKeys(const uint64_t *src, int k, int low, int mid, int high)
+{
+    int n1 = mid - low, n2 = high - mid;
+    int lo = k > n2 ? k - n2 : 0;
+    int hi = k < n1 ? k : n1;
+    while (lo < hi)
+    {
+        int i = lo + (hi - lo) / 2;
+        int j = k - i;
+        if (src[mid + j - 1] < src[low + i])
+            hi = i;
+        else
+            lo = i + 1;
+    }
+    return lo;
+}
+
+void mergeKeysParallel(const uint64_t *src, uint64_t *dst, int low, int mid, int high)
+{
+    int n = high - low;
+    int segments = omp_get_num_threads() * 4;
+    if (task_threshold > 0 && segments > n / task_threshold)
+        segments = n / task_threshold;
+    if (segments < 2)
+    {
+        mergeKeys(src, dst, low, mid, high);
+        return;
+    }
+    for (int seg = 0; seg < segments; seg++)
+    {
+        STATS_ADD(tasks_spawned, 1);
+#pragma omp task firstprivate(seg)
+        {
+            STATS_ADD(tasks_executed, 1);
+            int k0 = (int)((long int)n * seg / segments);
+            int k1 = (int)((long int)n * (seg + 1) / segments);
+            int i0 = coRankKeys(src, k0, low, mid, high);
+            int i1 = coRankKeys(src, k1, low, mid, high);
+            mergeRunsKeys(src, dst, low + i0, low + i1, mid + k0 - i0, mid + k1 - i1, low + k0);
+        }
+    }
+#pragma omp taskwait
+}
+
+void recMergeSortKeys(uint64_t *src, uint64_t *dst, int low, int high)
+{
+    if (high - low < 2)
+    {
+        if (high > low)
+            dst[low] = src[low];
+        return;
+    }
+    int mid = (low + high) / 2;
+    recMergeSortKeys(dst, src, low, mid);
+    recMergeSortKeys(dst, src, mid, high);
+    mergeKeys(src, dst, low, mid, high);
+}
+
+void recMergeSortKeysParallel(uint64_t *src, uint64_t *dst, int low, int high)
+{
+    if (high - low <= task_threshold || high - low < 2)
+    {
+        sortLeaf(dst + low, high - low, ASCENDING, 0);
+        return;
+    }
+    int mid = (low + high) / 2;
+    STATS_ADD(tasks_spawned, 1);
+#pragma omp task firstprivate(low, mid) if ((high - low) > task_threshold)
+    {
+        STATS_ADD(tasks_executed, 1);
+        recMergeSortKeysParallel(dst, src, low, mid);
+    }
+    STATS_ADD(tasks_spawned, 1);
+#pragma omp task firstprivate(mid, high) if ((high - low) > task_threshold)
+    {
+        STATS_ADD(tasks_executed, 1);
+        recMergeSortKeysParallel(dst, src, mid, high);
+    }
+#pragma omp taskwait
+    mergeKeysParallel(src, dst, low, mid, high);
+}
+
+void mergeSortKeys()
+{
+    uint64_t *aux = (uint64_t *)allocMergeBuffer(sizeof(uint64_t));
+    recMergeSortKeys(aux, keys, 0, N);
+    freeBuffer(aux, N * sizeof(uint64_t));
+}
+
+static void sortRangeKeys(void *src, void *dst, int low, int high)
+{
+    recMergeSortKeysParallel((uint64_t *)src, (uint64_t *)dst, low, high);
+}
+
+static void mergeRangeKeys(const void *src, void *dst, int low, int mid, int high)
+{
+    mergeKeysParallel((const uint64_t *)src, (uint64_t *)dst, low, mid, high);
+}
+
+void mergeSortKeysParallel()
+{
+    uint64_t *aux = (uint64_t *)allocMergeBuffer(sizeof(uint64_t));
+    if (numa_mode && numaNodeCount() > 1)
+    {
+        mergeSortNuma(aux, keys, sizeof(uint64_t), sortRangeKeys, mergeRangeKeys);
+    }
+    else
+    {
+#pragma omp parallel
+        {
+#pragma omp single
+            {
+                recMergeSortKeysParallel(aux, keys, 0, N);
+            }
+        }
+    }
+    freeBuffer(aux, N * sizeof(uint64_t));
+}
+
+/*
+ * LSD radix sort on the packed keys, one byte per pass.
+ *
+ * Each thread owns a contiguous chunk of the input and builds its own digit
+ * histogram. The per-(digit, thread) offsets are obtained with a prefix sum
+ * parallelized over digits, which keeps the scatter stable. Keys are staged in
+ * per-thread write-combining buffers of one cache line per digit, so the
+ * scatter writes full lines to the destination instead of single keys.
+ * Passes in which every key has the same digit are skipped.
+ */
+
+#define RADIX_BITS 8
+#define RADIX_BUCKETS (1 << RADIX_BITS)
+#define RADIX_PASSES (LENGTH * 8 / RADIX_BITS)
+#define WC_BYTES 64
+
+// Sorts n entries of `width` bytes that each start with a packed key. Always
+// inlined so that every caller gets a copy specialized for its entry width.
+static inline __attribute__((always_inline)) void radixSortEntries(char *data, long int n, const size_t width)
+{
+    int max_threads = omp_get_max_threads();
+    char *aux = (char *)malloc(n * width);
+    long int *hist = (long int *)malloc((size_t)max_threads * RADIX_BUCKETS * sizeof(long int));
+    long int *base = (long int *)malloc(RADIX_BUCKETS * sizeof(long int));
+    if (aux == NULL || hist == NULL || base == NULL)
+    {
+        perror("malloc radix");
+        exit(EXIT_FAILURE);
+    }
+
+    int skip = 0;
+    const int wcSlots = WC_BYTES / width;
+
+#pragma omp parallel
+    {
+        int tid = omp_get_thread_num();
+        int nthreads = omp_get_num_threads();
+        long int begin = n * tid / nthreads;
+        long int end = n * (tid + 1) / nthreads;
+        long int *myHist = hist + (size_t)tid * RADIX_BUCKETS;
+        char *src = data, *dst = aux;
+
+        char(*wc)[WC_BYTES] = malloc(RADIX_BUCKETS * sizeof(*wc));
+        int wcCount[RADIX_BUCKETS];
+        if (wc == NULL)
+        {
+            perror("malloc write-combining buffer");
+            exit(EXIT_FAILURE);
+        }
+
+        for (int pass = 0; pass < RADIX_PASSES; pass++)
+        {
+            int shift = pass * RADIX_BITS;
+
+            memset(myHist, 0, RADIX_BUCKETS * sizeof(long int));
+            for (long int i = begin; i < end; i++)
+                myHist[(*(const uint64_t *)(src + i * width) >> shift) & (RADIX_BUCKETS - 1)]++;
+#pragma omp barrier
+
+            // Exclusive scan down each digit column, across threads.
+#pragma omp for schedule(static)
+            for (int d = 0; d < RADIX_BUCKETS; d++)
+            {
+                long int sum = 0;
+                for (int t = 0; t < nthreads; t++)
+                {
+                    long int c = hist[(size_t)t * RADIX_BUCKETS + d];
+                    hist[(size_t)t * RADIX_BUCKETS + d] = sum;
+                    sum += c;
+                }
+                base[d] = sum;
+            }
+
+#pragma omp single
+            {
+                long int sum = 0;
+                skip = 0;
+                for (int d = 0; d < RADIX_BUCKETS; d++)
+                {
+                    long int c = base[d];
+                    if (c == n)
+                        skip = 1;
+                    base[d] = sum;
+                    sum += c;
+                }
+            }
+
+            if (skip)
+                continue;
+
+#pragma omp for schedule(static)
+            for (int d = 0; d < RADIX_BUCKETS; d++)
+                for (int t = 0; t < nthreads; t++)
+                    hist[(size_t)t * RADIX_BUCKETS + d] += base[d];
+
+            memset(wcCount, 0, sizeof(wcCount));
+            for (long int i = begin; i < end; i++)
+            {
+                const char *entry = src + i * width;
+                int d = (*(const uint64_t *)entry >> shift) & (RADIX_BUCKETS - 1);
+                memcpy(wc[d] + wcCount[d] * width, entry, width);
+                if (++wcCount[d] == wcSlots)
+                {
+                    memcpy(dst + myHist[d] * width, wc[d], wcSlots * width);
+                    myHist[d] += wcSlots;
+                    wcCount[d] = 0;
+                }
+            }
+            for (int d = 0; d < RADIX_BUCKETS; d++)
+                memcpy(dst + myHist[d] * width, wc[d], wcCount[d] * width);
+#pragma omp barrier
+
+            char *t = src;
+            src = dst;
+            dst = t;
+        }
+
+        free(wc);
+
+        if (src != data)
+        {
+#pragma omp for schedule(static)
+            for (long int i = 0; i < n; i++)
+                memcpy(data + i * width, src + i * width, width);
+        }
+    }
+
+    free(base);
+    free(hist);
+    free(aux);
+}
+
+void radixSortParallel()
+{
+    radixSortEntries((char *)keys, N, sizeof(uint64_t));
+}
+
+/*
+ * Sample sort on the packed keys.
+ *
+ * The data is split once: splitters are picked from a sorted random sample,
+ * oversampled to balance the buckets, and every thread classifies its own
+ * chunk, counting keys per bucket. A prefix sum over the (bucket, thread)
+ * counts gives each thread its write positions, so a single scatter puts every
+ * key in its final bucket. Buckets are then sorted independently, with no
+ * further synchronization, by the sequential ping-pong mergesort.
+ */
+
+#define SAMPLE_BUCKETS_PER_THREAD 4
+#define SAMPLE_OVERSAMPLING 32
+
+int compareUint64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Number of splitters <= key; `span` is the largest power of two <= nsplit.
+static inline int findBucket(const uint64_t *splitters, int nsplit, int span, uint64_t key)
+{
+    int b = 0;
+    for (int step = span; step > 0; step /= 2)
+        if (b + step <= nsplit && splitters[b + step - 1] <= key)
+            b += step;
+    return b;
+}
+
+void sampleSortParallel()
+{
+    int max_threads = omp_get_max_threads();
+    int max_buckets = max_threads * SAMPLE_BUCKETS_PER_THREAD;
+    int nsamples = max_buckets * SAMPLE_OVERSAMPLING;
+    uint64_t *aux = (uint64_t *)malloc(N * sizeof(uint64_t));
+    uint16_t *bucket_of = (uint16_t *)malloc(N * sizeof(uint16_t));
+    uint64_t *samples = (uint64_t *)malloc(nsamples * sizeof(uint64_t));
+    long int *counts = (long int *)malloc((size_t)max_threads * max_buckets * sizeof(long int));
+    long int *bucket_start = (long int *)malloc((max_buckets + 1) * sizeof(long int));
+    if (aux == NULL || bucket_of == NULL || samples == NULL || counts == NULL || bucket_start == NULL)
+    {
+        perror("malloc sample sort");
+        exit(EXIT_FAILURE);
+    }
+
+    int buckets = 0, nsplit = 0, span = 0;
+    uint64_t *splitters = samples;
+
+#pragma omp parallel
+    {
+        int tid = omp_get_thread_num();
+        int nthreads = omp_get_num_threads();
+        long int begin = N * tid / nthreads;
+        long int end = N * (tid + 1) / nthreads;
+
+#pragma omp single
+        {
+            buckets = nthreads * SAMPLE_BUCKETS_PER_THREAD;
+            int taken = buckets * SAMPLE_OVERSAMPLING;
+            uint64_t state = 0x9E3779B97F4A7C15ULL;
+            for (int s = 0; s < taken; s++)
+            {
+                state ^= state << 13;
+                state ^= state >> 7;
+                state ^= state << 17;
+                samples[s] = keys[state % N];
+            }
+            qsort(samples, taken, sizeof(uint64_t), compareUint64);
+            nsplit = buckets - 1;
+            for (int b = 0; b < nsplit; b++)
+                splitters[b] = samples[(b + 1) * SAMPLE_OVERSAMPLING];
+            span = 1;
+            while (span * 2 <= nsplit)
+                span *= 2;
+            if (nsplit == 0)
+                span = 0;
+        }
+
+        long int *myCounts = counts + (size_t)tid * buckets;
+        memset(myCounts, 0, buckets * sizeof(long int));
+        for (long int i = begin; i < end; i++)
+        {
+            int b = findBucket(splitters, nsplit, span, keys[i]);
+            bucket_of[i] = (uint16_t)b;
+            myCounts[b]++;
+        }
+#pragma omp barrier
+
+        // Exclusive scan down each bucket column, across threads.
+#pragma omp for schedule(static)
+        for (int b = 0; b < buckets; b++)
+        {
+            long int sum = 0;
+            for (int t = 0; t < nthreads; t++)
+            {
+                long int c = counts[(size_t)t * buckets + b];
+                counts[(size_t)t * buckets + b] = sum;
+                sum += c;
+            }
+            bucket_start[b + 1] = sum;
+        }
+
+#pragma omp single
+        {
+            bucket_start[0] = 0;
+            for (int b = 1; b <= buckets; b++)
+                bucket_start[b] += bucket_start[b - 1];
+        }
+
+        for (int b = 0; b < buckets; b++)
+            myCounts[b] += bucket_start[b];
+        for (long int i = begin; i < end; i++)
+            aux[myCounts[bucket_of[i]]++] = keys[i];
+#pragma omp barrier
+
+#pragma omp for schedule(dynamic, 1)
+        for (int b = 0; b < buckets; b++)
+        {
+            long int lo = bucket_start[b], hi = bucket_start[b + 1];
+            memcpy(keys + lo, aux + lo, (hi - lo) * sizeof(uint64_t));
+            recMergeSortKeys(aux, keys, lo, hi);
+        }
+    }
+
+    free(bucket_start);
+    free(counts);
+    free(samples);
+    free(bucket_of);
+    free(aux);
+}
+
+/*
+ * Counting sort for duplicate-heavy inputs ("-sort counting_parallel").
+ *
+ * A sample of evenly spaced keys estimates the number of distinct keys. When
+ * it is low, every thread counts its chunk into a private open-addressing
+ * table, the (key, count) entries of all tables are sorted and combined, and
+ * the counts are expanded back into `keys`, so the whole sort is one counting
+ * pass plus a sort of the distinct keys. If the sample says otherwise, or a
+ * table fills up because the sample missed keys, it falls back to sample sort.
+ * With -uniq the counts are written instead of being expanded (see below).
+ */
+
+#define CARDINALITY_SAMPLE 4096
+#define LOW_CARDINALITY_RATIO 16 // Low when the sample holds at most 1/16 distinct keys
+#define MIN_COUNT_TABLE 1024
+
+typedef struct
+{
+    uint64_t key;
+    long int count;
+} KeyCount;
+
+KeyCount *distinct_keys; // Distinct keys in ascending order with their counts
+long int distinct = 0;
+
+static inline unsigned long int hashKey(uint64_t key, int bits)
+{
+    return (key * 0x9E3779B97F4A7C15ULL) >> (64 - bits);
+}
+
+static int compareKeyCount(const void *a, const void *b)
+{
+    uint64_t x = ((const KeyCount *)a)->key, y = ((const KeyCount *)b)->key;
+    return (x > y) - (x < y);
+}
+
+// Distinct keys in an evenly spaced sample of the packed keys.
+long int sampleCardinality(long int *sample_size)
+{
+    long int n = N < CARDINALITY_SAMPLE ? N : CARDINALITY_SAMPLE;
+    uint64_t sample[CARDINALITY_SAMPLE];
+    for (long int i = 0; i < n; i++)
+        sample[i] = keys[N * i / n];
+    qsort(sample, n, sizeof(uint64_t), compareUint64);
+    long int count = n > 0;
+    for (long int i = 1; i < n; i++)
+        count += sample[i] != sample[i - 1];
+    *sample_size = n;
+    return count;
+}
+
+// Counts the keys into per-thread tables of 2^bits slots and combines them
+// into distinct_keys. Returns 0 if some table passed half full.
+int countKeys(int bits)
+{
+    long int capacity = 1L << bits;
+    int max_threads = omp_get_max_threads();
+    KeyCount *tables = (KeyCount *)malloc((size_t)max_threads * capacity * sizeof(KeyCount));
+    long int *used = (long int *)calloc(max_threads + 1, sizeof(long int));
+    if (tables == NULL || used == NULL)
+    {
+        perror("malloc count tables");
+        exit(EXIT_FAILURE);
+    }
+    int overflow = 0;
+
+#pragma omp parallel
+    {
+        int tid = omp_get_thread_num();
+        int nthreads = omp_get_num_threads();
+        long int begin = N * tid / nthreads;
+        long int end = N * (tid + 1) / nthreads;
+        KeyCount *table = tables + (size_t)tid * capacity;
+        for (long int slot = 0; slot < capacity; slot++)
+            table[slot].count = 0; // An empty slot, since every stored key counts at least once
+
+        long int size = 0;
+        for (long int i = begin; i < end; i++)
+        {
+            uint64_t key = keys[i];
+            unsigned long int slot = hashKey(key, bits);
+            while (table[slot].count != 0 && table[slot].key != key)
+                slot = (slot + 1) & (capacity - 1);
+            if (table[slot].count++ == 0)
+            {
+                table[slot].key = key;
+                if (++size > capacity / 2)
+                {
+#pragma omp atomic write
+                    overflow = 1;
+                    break;
+                }
+            }
+            if ((i & 0xFFFF) == 0)
+            {
+                int stop;
+#pragma omp atomic read
+                stop = overflow;
+                if (stop)
+                    break;
+            }
+        }
+
+        // Compact the table to its front
+        long int kept = 0;
+        for (long int slot = 0; slot < capacity && size > 0; slot++)
+            if (table[slot].count != 0)
+                table[kept++] = table[slot];
+        used[tid + 1] = kept;
+    }
+
+    if (overflow)
+    {
+        free(used);
+        free(tables);
+        return 0;
+    }
+
+    long int total = 0;
+    for (int t = 0; t < max_threads; t++)
+    {
+        memmove(tables + total, tables + (size_t)t * capacity, used[t + 1] * sizeof(KeyCount));
+        total += used[t + 1];
+    }
+    qsort(tables, total, sizeof(KeyCount), compareKeyCount);
+    distinct = 0;
+    for (long int i = 0; i < total; i++)
+    {
+        if (distinct > 0 && tables[distinct - 1].key == tables[i].key)
+            tables[distinct - 1].count += tables[i].count;
+        else
+            tables[distinct++] = tables[i];
+    }
+    distinct_keys = (KeyCount *)realloc(tables, (distinct > 0 ? distinct : 1) * sizeof(KeyCount));
+    free(used);
+    return 1;
+}
+
+// Writes distinct_keys back into `keys`, each key repeated `count` times.
+void expandCounts(void)
+{
+    long int *position = (long int *)malloc((distinct + 1) * sizeof(long int));
+    if (position == NULL)
+    {
+        perror("malloc count positions");
+        exit(EXIT_FAILURE);
+    }
+    position[0] = 0;
+    for (long int d = 0; d < distinct; d++)
+        position[d + 1] = position[d] + distinct_keys[d].count;
+
+#pragma omp parallel
+    {
+        // Split the output evenly; a few distinct keys may cover all of it
+        int tid = omp_get_thread_num();
+        int nthreads = omp_get_num_threads();
+        long int begin = N * tid / nthreads;
+        long int end = N * (tid + 1) / nthreads;
+        long int lo = 0, hi = distinct - 1;
+        while (lo < hi) // Last key starting at or before begin
+        {
+            long int mid = lo + (hi - lo + 1) / 2;
+            if (position[mid] <= begin)
+                lo = mid;
+            else
+                hi = mid - 1;
+        }
+        for (long int d = lo, i = begin; i < end; d++)
+        {
+            long int stop = position[d + 1] < end ? position[d + 1] : end;
+            for (; i < stop; i++)
+                keys[i] = distinct_keys[d].key;
+        }
+    }
+    free(position);
+}
+
+void countingSortParallel()
+{
+    long int sample_size;
+    long int cardinality = sampleCardinality(&sample_size);
+    if (cardinality * LOW_CARDINALITY_RATIO <= sample_size)
+    {
+        int bits = 1;
+        while ((1L << bits) < MIN_COUNT_TABLE || (1L << bits) < cardinality * 8)
+            bits++;
+        if (countKeys(bits))
+        {
+            if (!uniq_mode)
+                expandCounts();
+            return;
+        }
+    }
+    sampleSortParallel();
+}
+
+/*
+ * Unique output ("-uniq"), like `uniq -c` on the sorted output: one line per
+ * distinct key with its count. counting_parallel provides the counts directly;
+ * after any other method they are read off the sorted keys.
+ */
+
+// Run-length encodes the sorted packed keys into distinct_keys.
+void countRuns(void)
+{
+    int max_threads = omp_get_max_threads();
+    long int *first = (long int *)calloc(max_threads + 1, sizeof(long int));
+    if (first == NULL)
+    {
+        perror("malloc run offsets");
+        exit(EXIT_FAILURE);
+    }
+
+#pragma omp parallel
+    {
+        int tid = omp_get_thread_num();
+        int nthreads = omp_get_num_threads();
+        long int begin = N * tid / nthreads;
+        long int end = N * (tid + 1) / nthreads;
+        long int runs = 0;
+        for (long int i = begin; i < end; i++)
+            runs += i == 0 || keys[i] != keys[i - 1];
+        first[tid + 1] = runs;
+#pragma omp barrier
+#pragma omp single
+        {
+            for (int t = 1; t <= nthreads; t++)
+                first[t] += first[t - 1];
+            distinct = first[nthreads];
+            distinct_keys = (KeyCount *)malloc((distinct > 0 ? distinct : 1) * sizeof(KeyCount));
+            if (distinct_keys == NULL)
+            {
+                perror("malloc distinct keys");
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        // Store where every run starts, then turn the starts into counts. The
+        // start of the next thread's first run is read before anyone converts.
+        long int d = first[tid];
+        for (long int i = begin; i < end; i++)
+        {
+            if (i == 0 || keys[i] != keys[i - 1])
+            {
+                distinct_keys[d].key = keys[i];
+                distinct_keys[d++].count = i;
+            }
+        }
+#pragma omp barrier
+        long int next = first[tid + 1] < distinct ? distinct_keys[first[tid + 1]].count : N;
+#pragma omp barrier
+        for (long int r = first[tid + 1] - 1; r >= first[tid]; r--)
+        {
+            long int start = distinct_keys[r].count;
+            distinct_keys[r].count = next - start;
+            next = start;
+        }
+    }
+    free(first);
+}
+
+static inline int countDigits(long int v)
+{
+    int digits = 1;
+    while (v >= 10)
+    {
+        v /= 10;
+        digits++;
+    }
+    return digits;
+}
+
+// Lines look like `uniq -c` output: the count right-aligned in 7 columns.
+static size_t uniqLineLength(long int i)
+{
+    int digits = countDigits(distinct_keys[i].count);
+    return (digits > 7 ? digits : 7) + 1 + keyLength(distinct_keys[i].key) + 1;
+}
+
+static size_t formatUniq(char *p, long int i)
+{
+    int width = sprintf(p, "%7ld ", distinct_keys[i].count);
+    uint64_t bytes = toBigEndian(distinct_keys[i].key);
+    memcpy(p + width, &bytes, LENGTH);
+    int len = keyLength(distinct_keys[i].key);
+    p[width + len] = '\n';
+    return width + len + 1;
+}
+
+void writeUniqOutput(void)
+{
+    if (distinct_keys == NULL)
+        countRuns();
+    writeEntries(distinct, 20 + 1 + LENGTH + 1, uniqLineLength, formatUniq, NULL);
+}
+
+/*
+ * Partial sort ("-topk K").
+ *
+ * Only the K smallest keys are sorted and written. Each thread scans its chunk
+ * of the packed keys with a bounded max-heap of min(K, chunk) keys: a key that
+ * is not smaller than the heap top is rejected with one compare, so the scan is
+ * close to linear when K is small. Each thread then heap-sorts its candidates,
+ * and rounds of parallel pairwise merges combine the sorted heaps, whose first
+ * K keys are moved to the front of `keys`. There are never more than N
+ * candidates, so a K close to N costs about as much as a full sort.
+ */
+
+void selectTopK(long int k)
+{
+    packKeys();
+    if (k > N)
+        k = N;
+    int max_threads = omp_get_max_threads();
+    long int *found = (long int *)calloc(max_threads + 1, sizeof(long int));
+    if (found == NULL)
+    {
+        perror("malloc top-k");
+        exit(EXIT_FAILURE);
+    }
+
+    uint64_t *candidates = NULL, *aux = NULL;
+#pragma omp parallel
+    {
+        int tid = omp_get_thread_num();
+        int nthreads = omp_get_num_threads();
+        long int begin = N * tid / nthreads;
+        long int end = N * (tid + 1) / nthreads;
+        long int size = end - begin < k ? end - begin : k;
+        found[tid + 1] = size;
+#pragma omp barrier
+#pragma omp single
+        {
+            for (int t = 1; t <= nthreads; t++)
+                found[t] += found[t - 1];
+            candidates = (uint64_t *)malloc((found[nthreads] > 0 ? found[nthreads] : 1) * sizeof(uint64_t));
+            aux = (uint64_t *)malloc((found[nthreads] > 0 ? found[nthreads] : 1) * sizeof(uint64_t));
+            if (candidates == NULL || aux == NULL)
+            {
+                perror("malloc top-k");
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        uint64_t *heap = candidates + found[tid];
+        memcpy(heap, keys + begin, size * sizeof(uint64_t));
+        for (long int i = size / 2 - 1; i >= 0; i--)
+            siftDown(heap, size, i);
+        for (long int i = begin + size; i < end; i++)
+        {
+            if (keys[i] < heap[0])
+            {
+                heap[0] = keys[i];
+                siftDown(heap, size, 0);
+            }
+        }
+        for (long int last = size - 1; last > 0; last--) // Heap-sort the candidates in place
+        {
+            uint64_t top = heap[0];
+            heap[0] = heap[last];
+            heap[last] = top;
+            siftDown(heap, last, 0);
+        }
+#pragma omp barrier
+#pragma omp single
+        {
+            // Merge neighbouring sorted heaps pairwise, doubling the run width each round
+            for (int width = 1; width < nthreads; width *= 2)
+            {
+                for (int t = 0; t < nthreads; t += 2 * width)
+                {
+                    int low = (int)found[t];
+                    int mid = (int)found[t + width < nthreads ? t + width : nthreads];
+                    int high = (int)found[t + 2 * width < nthreads ? t + 2 * width : nthreads];
+#pragma omp task firstprivate(low, mid, high)
+                    {
+                        if (mid < high)
+                            mergeKeysParallel(candidates, aux, low, mid, high);
+                        else
+                            memcpy(aux + low, candidates + low, (high - low) * sizeof(uint64_t));
+                    }
+                }
+#pragma omp taskwait
+                uint64_t *t = candidates;
+                candidates = aux;
+                aux = t;
+            }
+        }
+    }
+
+    memcpy(keys, candidates, k * sizeof(uint64_t));
+    free(found);
+    free(aux);
+    free(candidates);
+}
+
+/*
+ * Argsort ("-argsort perm|records").
+ *
+ * Records are the input lines, keyed by their packed first LENGTH - 1 bytes.
+ * Instead of moving records, the sorts move 16-byte (key, row) pairs, so the
+ * hot loops cost the same whatever the record width. Only stable methods are
+ * offered, so records with equal keys keep their input order. The output is
+ * either the permutation (one row number per line) or the records gathered in
+ * sorted order from the mapped input, in one streaming pass.
+ */
+
+typedef struct
+{
+    uint64_t key;
+    uint64_t row;
+} KeyIndex;
+
+KeyIndex *pairs;
+
+void mergePairs(const KeyIndex *src, KeyIndex *dst, int low, int mid, int high)
+{
+    int i = low, j = mid, k = low;
+    while (i < mid && j < high)
+    {
+        int takeLeft = src[i].key <= src[j].key;
+        dst[k++] = takeLeft ? src[i] : src[j];
+        i += takeLeft;
+        j += !takeLeft;
+    }
+    memcpy(dst + k, src + i, (mid - i) * sizeof(KeyIndex));
+    k += mid - i;
+    memcpy(dst + k, src + j, (high - j) * sizeof(KeyIndex));
+}
+
+void recMergeSortPairs(KeyIndex *src, KeyIndex *dst, int low, int high)
+{
+    if (high - low < 2)
+    {
+        if (high > low)
+            dst[low] = src[low];
+        return;
+    }
+    int mid = (low + high) / 2;
+    recMergeSortPairs(dst, src, low, mid);
+    recMergeSortPairs(dst, src, mid, high);
+    mergePairs(src, dst, low, mid, high);
+}
+
+void recMergeSortPairsParallel(KeyIndex *src, KeyIndex *dst, int low, int high)
+{
+    if (high - low < 2)
+    {
+        if (high > low)
+            dst[low] = src[low];
+        return;
+    }
+    int mid = (low + high) / 2;
+    STATS_ADD(tasks_spawned, 1);
+#pragma omp task firstprivate(low, mid) if ((high - low) > task_threshold)
+    {
+        STATS_ADD(tasks_executed, 1);
+        recMergeSortPairsParallel(dst, src, low, mid);
+    }
+    STATS_ADD(tasks_spawned, 1);
+#pragma omp task firstprivate(mid, high) if ((high - low) > task_threshold)
+    {
+        STATS_ADD(tasks_executed, 1);
+        recMergeSortPairsParallel(dst, src, mid, high);
+    }
+#pragma omp taskwait
+    mergePairs(src, dst, low, mid, high);
+}
+
+void sortPairs(const char *method)
+{
+    int radix = strcmp(method, "radix_parallel") == 0;
+    int parallel_merge = strcmp(method, "mergesort_parallel") == 0;
+    if (!radix && !parallel_merge && strcmp(method, "mergesort") != 0)
+    {
+        fprintf(stderr, "Sorting method %s is not available with -argsort (use mergesort, mergesort_parallel or "
+                        "radix_parallel)\n",
+                method);
+        exit(EXIT_FAILURE);
+    }
+
+    // The mergesorts ping-pong with a second copy of the pairs.
+    pairs = (KeyIndex *)malloc(N * sizeof(KeyIndex));
+    KeyIndex *aux = radix ? NULL : (KeyIndex *)malloc(N * sizeof(KeyIndex));
+    if (pairs == NULL || (!radix && aux == NULL))
+    {
+        perror("malloc pairs");
+        exit(EXIT_FAILURE);
+    }
+#pragma omp parallel for schedule(static)
+    for (long int i = 0; i < N; i++)
+    {
+        pairs[i].key = keys[i];
+        pairs[i].row = i;
+        if (aux != NULL)
+            aux[i] = pairs[i];
+    }
+
+    if (radix)
+    {
+        radixSortEntries((char *)pairs, N, sizeof(KeyIndex));
+    }
+    else if (parallel_merge)
+    {
+#pragma omp parallel
+        {
+#pragma omp single
+            {
+                recMergeSortPairsParallel(aux, pairs, 0, N);
+            }
+        }
+    }
+    else
+    {
+        recMergeSortPairs(aux, pairs, 0, N);
+    }
+    free(aux);
+}
+
+static size_t permutationLineLength(long int i)
+{
+    size_t digits = 1;
+    for (uint64_t row = pairs[i].row; row >= 10; row /= 10)
+        digits++;
+    return digits + 1;
+}
+
+static size_t formatPermutation(char *p, long int i)
+{
+    size_t len = permutationLineLength(i);
+    uint64_t row = pairs[i].row;
+    p[len - 1] = '\n';
+    for (size_t d = len - 1; d > 0; d--)
+    {
+        p[d - 1] = '0' + row % 10;
+        row /= 10;
+    }
+    return len;
+}
+
+static size_t recordLineLength(long int i)
+{
+    const char *start = input_data + record_start[pairs[i].row];
+    const char *end = input_data + input_size;
+    const char *nl = memchr(start, '\n', end - start);
+    return (nl ? nl : end) - start + 1;
+}
+
+static size_t formatRecord(char *p, long int i)
+{
+    size_t len = recordLineLength(i);
+    memcpy(p, input_data + record_start[pairs[i].row], len - 1);
+    p[len - 1] = '\n';
+    return len;
+}
+
+void writeArgsortOutput(void)
+{
+    if (argsort_mode == ARGSORT_PERMUTATION)
+    {
+        writeEntries(N, 21, permutationLineLength, formatPermutation, NULL);
+        return;
+    }
+
+    // Records end where the next one starts, so this bounds every line.
+    long int max_record = input_size - record_start[N - 1];
+#pragma omp parallel for reduction(max : max_record)
+    for (long int i = 1; i < N; i++)
+        if (record_start[i] - record_start[i - 1] > max_record)
+            max_record = record_start[i] - record_start[i - 1];
+    writeEntries(N, max_record + 1, recordLineLength, formatRecord, NULL);
+}
+
+/*
+ * Variable-length keys ("-varlen").
+ *
+ * The whole input is read into one string arena with a single bulk read, and
+ * every line becomes a 16-byte reference: its first 8 bytes as a big-endian
+ * prefix, plus its arena offset and length packed into one word. Most
+ * comparisons are decided on the prefixes in registers; the arena is only read
+ * when two prefixes tie. Lines compare as byte strings, like LC_ALL=C sort.
+ */
+
+#define REF_LENGTH_BITS 24
+#define REF_MAX_LENGTH ((1L << REF_LENGTH_BITS) - 1)
+#define REF_OFFSET(ref) ((ref).location >> REF_LENGTH_BITS)
+#define REF_LENGTH(ref) ((long int)((ref).location & REF_MAX_LENGTH))
+
+typedef struct
+{
+    uint64_t prefix;
+    uint64_t location; // Arena offset << REF_LENGTH_BITS | length
+} StringRef;
+
+char *arena;
+StringRef *refs;
+long int max_ref_length;
+
+static inline int compareRefs(StringRef a, StringRef b)
+{
+    if (a.prefix != b.prefix)
+        return a.prefix < b.prefix ? -1 : 1;
+    long int la = REF_LENGTH(a), lb = REF_LENGTH(b);
+    if (la > 8 && lb > 8)
+    {
+        int c = memcmp(arena + REF_OFFSET(a) + 8, arena + REF_OFFSET(b) + 8, (la < lb ? la : lb) - 8);
+        if (c != 0)
+            return c;
+    }
+    return (la > lb) - (la < lb);
+}
+
+static void parseRef(long int i, const char *line, long int len, void *ctx)
+{
+    (void)ctx; // Refs go to the global array
+    if (len > REF_MAX_LENGTH)
+    {
+        fprintf(stderr, "Line %ld is longer than %ld bytes\n", i + 1, REF_MAX_LENGTH);
+        exit(EXIT_FAILURE);
+    }
+    int n = len < 8 ? (int)len : 8;
+    uint64_t prefix = 0;
+    for (int c = 0; c < n; c++)
+        prefix = (prefix << 8) | (unsigned char)line[c];
+    refs[i].prefix = n == 0 ? 0 : prefix << (8 * (8 - n));
+    refs[i].location = (uint64_t)(line - arena) << REF_LENGTH_BITS | len;
+}
+
+void loadVarlen(const char *input_file)
+{
+    int fd = open(input_file, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0 || st.st_size == 0)
+    {
+        perror("open input");
+        fprintf(stderr, "Error opening input file: %s\n", input_file);
+        exit(EXIT_FAILURE);
+    }
+    size_t size = st.st_size;
+    arena = (char *)malloc(size + 1);
+    if (arena == NULL)
+    {
+        perror("malloc arena");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t done = 0; done < size;)
+    {
+        ssize_t got = read(fd, arena + done, size - done);
+        if (got <= 0)
+        {
+            perror("read input");
+            exit(EXIT_FAILURE);
+        }
+        done += got;
+    }
+    close(fd);
+    arena[size] = '\0'; // Stops strtol on a header-only file
+
+    const char *end = arena + size;
+    const char *body = parseHeader(arena, end, &N);
+    checkKeyCount(N, 0);
+
+    refs = (StringRef *)malloc(N * sizeof(StringRef));
+    if (refs == NULL)
+    {
+        perror("malloc refs");
+        exit(EXIT_FAILURE);
+    }
+    long int lines = walkLines(body, end, N, parseRef, NULL);
+    if (lines < N)
+    {
+        fprintf(stderr, "Input file %s has %ld elements, expected %ld\n", input_file, lines, N);
+        exit(EXIT_FAILURE);
+    }
+
+    max_ref_length = 0;
+#pragma omp parallel for schedule(static) reduction(max : max_ref_length)
+    for (long int i = 0; i < N; i++)
+        if (REF_LENGTH(refs[i]) > max_ref_length)
+            max_ref_length = REF_LENGTH(refs[i]);
+}
+
+void mergeRefs(const StringRef *src, StringRef *dst, int low, int mid, int high)
+{
+    int i = low, j = mid, k = low;
+    while (i < mid && j < high)
+    {
+        if (compareRefs(src[i], src[j]) <= 0)
+            dst[k++] = src[i++];
+        else
+            dst[k++] = src[j++];
+    }
+    memcpy(dst + k, src + i, (mid - i) * sizeof(StringRef));
+    k += mid - i;
+    memcpy(dst + k, src + j, (high - j) * sizeof(StringRef));
+}
+
+void recMergeSortRefs(StringRef *src, StringRef *dst, int low, int high)
+{
+    if (high - low < 2)
+    {
+        if (high > low)
+            dst[low] = src[low];
+        return;
+    }
+    int mid = (low + high) / 2;
+    recMergeSortRefs(dst, src, low, mid);
+    recMergeSortRefs(dst, src, mid, high);
+    mergeRefs(src, dst, low, mid, high);
+}
+
+void recMergeSortRefsParallel(StringRef *src, StringRef *dst, int low, int high)
+{
+    if (high - low < 2)
+    {
+        if (high > low)
+            dst[low] = src[low];
+        return;
+    }
+    int mid = (low + high) / 2;
+    STATS_ADD(tasks_spawned, 1);
+#pragma omp task firstprivate(low, mid) if ((high - low) > task_threshold)
+    {
+        STATS_ADD(tasks_executed, 1);
+        recMergeSortRefsParallel(dst, src, low, mid);
+    }
+    STATS_ADD(tasks_spawned, 1);
+#pragma omp task firstprivate(mid, high) if ((high - low) > task_threshold)
+    {
+        STATS_ADD(tasks_executed, 1);
+        recMergeSortRefsParallel(dst, src, mid, high);
+    }
+#pragma omp taskwait
+    mergeRefs(src, dst, low, mid, high);
+}
+
+void sortRefs(const char *method)
+{
+    int parallel = strcmp(method, "mergesort_parallel") == 0;
+    if (!parallel && strcmp(method, "mergesort") != 0)
+    {
+        fprintf(stderr, "Sorting method %s is not available with -varlen (use mergesort or mergesort_parallel)\n",
+                method);
+        exit(EXIT_FAILURE);
+    }
+
+    StringRef *aux = (StringRef *)malloc(N * sizeof(StringRef));
+    if (aux == NULL)
+    {
+        perror("malloc merge buffer");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(aux, refs, N * sizeof(StringRef));
+    if (parallel)
+    {
+#pragma omp parallel
+        {
+#pragma omp single
+            {
+                recMergeSortRefsParallel(aux, refs, 0, N);
+            }
+        }
+    }
+    else
+    {
+        recMergeSortRefs(aux, refs, 0, N);
+    }
+    free(aux);
+}
+
+static size_t refLineLength(long int i)
+{
+    return REF_LENGTH(refs[i]) + 1;
+}
+
+static size_t formatRef(char *p, long int i)
+{
+    long int len = REF_LENGTH(refs[i]);
+    memcpy(p, arena + REF_OFFSET(refs[i]), len);
+    p[len] = '\n';
+    return len + 1;
+}
+
+void sortVarlen(const char *input_file, const char *method, double *load_time, double *total_time,
+                double *write_time)
+{
+    double startTime = omp_get_wtime();
+    loadVarlen(input_file);
+    *load_time = omp_get_wtime() - startTime;
+
+    startTime = omp_get_wtime();
+    sortRefs(method);
+    *total_time = omp_get_wtime() - startTime;
+
+    startTime = omp_get_wtime();
+    writeEntries(N, max_ref_length + 1, refLineLength, formatRef, NULL);
+    *write_time = omp_get_wtime() - startTime;
+
+    free(refs);
+    free(arena);
+}
+
+void sortKeys(const char *method)
+{
+    initSimdKernels();
+    packKeys();
+    if (strcmp(method, "bitonic") == 0)
+    {
+        bitonicSortKeys();
+    }
+    else if (strcmp(method, "bitonic_parallel") == 0)
+    {
+        bitonicSortKeysParallel();
+    }
+    else if (strcmp(method, "mergesort") == 0)
+    {
+        mergeSortKeys();
+    }
+    else if (strcmp(method, "mergesort_parallel") == 0)
+    {
+        mergeSortKeysParallel();
+    }
+    else if (strcmp(method, "radix_parallel") == 0)
+    {
+        radixSortParallel();
+    }
+    else if (strcmp(method, "bitonic_blocked") == 0)
+    {
+        bitonicSortBlocked();
+    }
+    else if (strcmp(method, "samplesort_parallel") == 0)
+    {
+        sampleSortParallel();
+    }
+    else if (strcmp(method, "counting_parallel") == 0)
+    {
+        countingSortParallel();
+    }
+    else if (strcmp(method, "bitonic_dataflow") == 0)
+    {
+        bitonicSortDataflow();
+    }
+    else if (strcmp(method, "bitonic_static") == 0)
+    {
+        bitonicSortStatic();
+    }
+    else
+    {
+        fprintf(stderr, "Unknown sorting method: %s\n", method);
+        exit(EXIT_FAILURE);
+    }
+}
+
+int usesPackedKeys(const char *method)
+{
+    // Radix, blocked, dataflow and static bitonic, sample and counting sort only exist for packed keys.
+    return packed_mode || strcmp(method, "radix_parallel") == 0 || strcmp(method, "bitonic_blocked") == 0 ||
+           strcmp(method, "samplesort_parallel") == 0 || strcmp(method, "counting_parallel") == 0 ||
+           strcmp(method, "bitonic_dataflow") == 0 || strcmp(method, "bitonic_static") == 0;
+}
+
+int requiresPowerOfTwo(const char *method)
+{
+    return strncmp(method, "bitonic", strlen("bitonic")) == 0;
+}
+
+void sort(const char *method)
+{
+    if (usesPackedKeys(method))
+    {
+        sortKeys(method);
+    }
+    else if (strcmp(method, "bitonic") == 0)
+    {
+        bitonicSort();
+    }
+    else if (strcmp(method, "bitonic_parallel") == 0)
+    {
+        bitonicSortParallel();
+    }
+    else if (strcmp(method, "mergesort") == 0)
+    {
+        mergeSort();
+    }
+    else if (strcmp(method, "mergesort_parallel") == 0)
+    {
+        mergeSortParallel();
+    }
+    else
+    {
+        fprintf(stderr, "Unknown sorting method: %s\n", method);
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+ * Task threshold auto-tuning ("-t auto").
+ *
+ * The best cutoff depends on the method, the thread count and the machine, so
+ * it is calibrated by timing the method on a sample of the loaded input for a
+ * range of candidate thresholds. The winner is appended to a small profile in
+ * the working directory, keyed by host name, method (and whether it runs on
+ * packed keys) and thread count, so later runs with the same key read it back
+ * instead of calibrating again.
+ */
+
+#define TUNING_SAMPLE (1 << 18)
+#define TUNING_MIN_THRESHOLD 256
+#define TUNING_MAX_THRESHOLD 65536
+#define TUNING_REPETITIONS 2
+
+int usesTaskThreshold(const char *method)
+{
+    return strcmp(method, "bitonic_parallel") == 0 || strcmp(method, "mergesort_parallel") == 0 ||
+           strcmp(method, "bitonic_dataflow") == 0;
+}
+
+int readTuningProfile(const char *host, const char *method, int threads)
+{
+    FILE *profile = fopen(TUNING_PROFILE_FILE, "r");
+    if (profile == NULL)
+        return 0;
+    char line[512], entry_host[256], entry_method[48];
+    int entry_threads, entry_threshold, threshold = 0;
+    while (fgets(line, sizeof(line), profile))
+    {
+        if (sscanf(line, "%255s %47s %d %d", entry_host, entry_method, &entry_threads, &entry_threshold) == 4 &&
+            strcmp(entry_host, host) == 0 && strcmp(entry_method, method) == 0 && entry_threads == threads)
+            threshold = entry_threshold; // Later entries win
+    }
+    fclose(profile);
+    return threshold;
+}
+
+void writeTuningProfile(const char *host, const char *method, int threads, int threshold)
+{
+    FILE *profile = fopen(TUNING_PROFILE_FILE, "a");
+    if (profile == NULL)
+    {
+        perror("fopen tuning profile");
+        return;
+    }
+    fprintf(profile, "%s %s %d %d\n", host, method, threads, threshold);
+    fclose(profile);
+}
+
+// Sorts a fresh copy of `sample` with the current globals pointed at it, as
+// key/row pairs under -argsort.
+double timeSampleSort(const char *method, const char *sample, char *scratch, long int n)
+{
+    char *saved_strings = strings;
+    long int saved_N = N;
+
+    memcpy(scratch, sample, n * LENGTH);
+    strings = scratch;
+    keys = (uint64_t *)scratch;
+    N = n;
+
+    double startTime = omp_get_wtime();
+    if (argsort_mode != ARGSORT_NONE)
+        sortPairs(method);
+    else
+        sort(method);
+    double time = omp_get_wtime() - startTime;
+    if (argsort_mode != ARGSORT_NONE)
+    {
+        free(pairs);
+        pairs = NULL;
+    }
+
+    strings = saved_strings;
+    keys = (uint64_t *)saved_strings;
+    N = saved_N;
+    return time;
+}
+
+void tuneTaskThreshold(const char *method)
+{
+    if (!usesTaskThreshold(method))
+        return;
+    // Of the argsort methods only mergesort_parallel spawns tasks
+    if (argsort_mode != ARGSORT_NONE && strcmp(method, "mergesort_parallel") != 0)
+        return;
+
+    char host[256] = "unknown";
+    gethostname(host, sizeof(host));
+    host[sizeof(host) - 1] = '\0';
+    int threads = omp_get_max_threads();
+    char profile_key[48];
+    snprintf(profile_key, sizeof(profile_key), "%s%s%s", method, packed_mode ? "+packed" : "",
+             argsort_mode != ARGSORT_NONE ? "+argsort" : "");
+
+    int cached = readTuningProfile(host, profile_key, threads);
+    if (cached > 0)
+    {
+        task_threshold = cached;
+        return;
+    }
+
+    long int n = N < TUNING_SAMPLE ? N : TUNING_SAMPLE;
+    char *scratch = (char *)malloc(n * LENGTH);
+    if (scratch == NULL)
+    {
+        perror("malloc tuning sample");
+        exit(EXIT_FAILURE);
+    }
+
+    int best_threshold = task_threshold;
+    double best_time = -1.0;
+    for (int candidate = TUNING_MIN_THRESHOLD; candidate <= TUNING_MAX_THRESHOLD && candidate <= n; candidate *= 2)
+    {
+        task_threshold = candidate;
+        double time = timeSampleSort(method, strings, scratch, n);
+        for (int rep = 1; rep < TUNING_REPETITIONS; rep++)
+        {
+            double t = timeSampleSort(method, strings, scratch, n);
+            time = t < time ? t : time;
+        }
+        if (best_time < 0 || time < best_time)
+        {
+            best_time = time;
+            best_threshold = candidate;
+        }
+    }
+    free(scratch);
+
+    task_threshold = best_threshold;
+    // Tiny inputs have no candidates to try, so there is nothing worth caching.
+    if (best_time >= 0)
+        writeTuningProfile(host, profile_key, threads, task_threshold);
+}
+
+/*
+ * In-process benchmark ("-bench reps").
+ *
+ * The input is loaded once and kept as a pristine copy, in string and packed
+ * form, that is restored before every run. Each combination of the methods
+ * given to -sort, the thresholds given to -t and the thread counts given to
+ * -threads (all comma-separated) gets `bench_warmups` untimed runs and
+ * `bench_repetitions` timed ones. Like scripts/batch_test.py, sequential
+ * methods only run on one thread and methods without tasks ignore the
+ * threshold. Results use the batch_test.py schema plus min and median; the
+ * output file is not written, so mean_write_time is 0.
+ */
+
+#define BENCH_LIST_MAX 64
+
+// Splits a comma-separated list in place, returning the number of items.
+static int splitList(char *list, char **items)
+{
+    int count = 0;
+    char *save;
+    for (char *item = strtok_r(list, ",", &save); item != NULL && count < BENCH_LIST_MAX;
+         item = strtok_r(NULL, ",", &save))
+        items[count++] = item;
+    return count;
+}
+
+static int compareDouble(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+int isSequential(const char *method)
+{
+    return strcmp(method, "bitonic") == 0 || strcmp(method, "mergesort") == 0;
+}
+
+void restoreInput(const char *method, const char *pristine, const char *pristine_packed)
+{
+    int packed = usesPackedKeys(method);
+    memcpy(strings, packed ? pristine_packed : pristine, N * LENGTH);
+    keys_packed = packed;
+}
+
+void runBenchmark(const char *input_file, const char *default_method)
+{
+    char methods_buf[1024], thresholds_buf[1024], threads_buf[1024];
+    char *methods[BENCH_LIST_MAX], *thresholds[BENCH_LIST_MAX], *threads[BENCH_LIST_MAX];
+    snprintf(methods_buf, sizeof(methods_buf), "%s", method_list ? method_list : default_method);
+    if (threshold_list)
+        snprintf(thresholds_buf, sizeof(thresholds_buf), "%s", threshold_list);
+    else
+        snprintf(thresholds_buf, sizeof(thresholds_buf), "%d", task_threshold);
+    if (thread_list)
+        snprintf(threads_buf, sizeof(threads_buf), "%s", thread_list);
+    else
+        snprintf(threads_buf, sizeof(threads_buf), "%d", omp_get_max_threads());
+    int nmethods = splitList(methods_buf, methods);
+    int nthresholds = splitList(thresholds_buf, thresholds);
+    int nthreads = splitList(threads_buf, threads);
+
+    int power_of_two = 0;
+    for (int m = 0; m < nmethods; m++)
+        power_of_two |= requiresPowerOfTwo(methods[m]);
+
+    double loadStartTime = omp_get_wtime();
+    mapInput(input_file);
+    loadInput(input_file, 0, power_of_two, 0);
+    unmapInput();
+    double load_time = omp_get_wtime() - loadStartTime;
+
+    char *pristine = (char *)malloc(N * LENGTH);
+    char *pristine_packed = (char *)malloc(N * LENGTH);
+    double *times = (double *)malloc((bench_repetitions > 0 ? bench_repetitions : 1) * sizeof(double));
+    if (pristine == NULL || pristine_packed == NULL || times == NULL)
+    {
+        perror("malloc benchmark");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(pristine, strings, N * LENGTH);
+    packKeys();
+    memcpy(pristine_packed, strings, N * LENGTH);
+
+    if (csv_mode)
+        printf("sort_method,input_file,N,task_threshold,omp_num_threads,repetitions,mean_time,std_deviation,"
+               "individual_times,mean_load_time,mean_write_time,min_time,median_time\n");
+
+    for (int m = 0; m < nmethods; m++)
+    {
+        const char *method = methods[m];
+        int thread_count = isSequential(method) ? 1 : nthreads;
+        int threshold_count = usesTaskThreshold(method) ? nthresholds : 1;
+        for (int t = 0; t < thread_count; t++)
+        {
+            int thr = isSequential(method) ? 1 : atoi(threads[t]);
+            omp_set_num_threads(thr);
+            for (int h = 0; h < threshold_count; h++)
+            {
+                const char *threshold = usesTaskThreshold(method) ? thresholds[h] : "0";
+                if (strcmp(threshold, "auto") == 0)
+                {
+                    restoreInput(method, pristine, pristine_packed);
+                    tuneTaskThreshold(method);
+                }
+                else
+                {
+                    task_threshold = atoi(threshold);
+                }
+
+                for (int rep = -bench_warmups; rep < bench_repetitions; rep++)
+                {
+                    restoreInput(method, pristine, pristine_packed);
+                    double startTime = omp_get_wtime();
+                    sort(method);
+                    double time = omp_get_wtime() - startTime;
+                    if (rep >= 0)
+                        times[rep] = time;
+                }
+
+                int reps = bench_repetitions;
+                double mean = 0.0, variance = 0.0;
+                for (int rep = 0; rep < reps; rep++)
+                    mean += times[rep] / reps;
+                for (int rep = 0; rep < reps; rep++)
+                    variance += (times[rep] - mean) * (times[rep] - mean);
+                double stddev = reps > 1 ? sqrt(variance / (reps - 1)) : 0.0;
+
+                if (csv_mode)
+                {
+                    printf("%s,%s,%ld,%s,%d,%d,%.6lf,%.6lf,\"[", method, input_file, N, threshold, thr, reps, mean,
+                           stddev);
+                    for (int rep = 0; rep < reps; rep++)
+                        printf(rep ? ", %.6lf" : "%.6lf", times[rep]);
+                    printf("]\",%.6lf,%.6lf,", load_time, 0.0);
+                }
+                qsort(times, reps, sizeof(double), compareDouble);
+                double median = reps % 2 ? times[reps / 2] : (times[reps / 2 - 1] + times[reps / 2]) / 2;
+                if (csv_mode)
+                    printf("%.6lf,%.6lf\n", times[0], median);
+                else
+                    printf("Sort: %s | threshold: %s (%d), threads: %d -> min %.6lf s, median %.6lf s, mean %.6lf s, "
+                           "std dev %.6lf s over %d runs\n",
+                           method, threshold, task_threshold, thr, times[0], median, mean, stddev, reps);
+                fflush(stdout);
+            }
+        }
+    }
+
+    free(times);
+    free(pristine_packed);
+    free(pristine);
+}
+
+/*
+ * External-memory sort ("-mem MiB").
+ *
+ * When the input does not fit in the memory budget, it is parsed from the
+ * mapped file in chunks of half the budget (the other half is the sorts'
+ * auxiliary buffer). Each chunk is sorted on packed keys with the selected
+ * method and spilled to a binary run file. The runs are then merged with a
+ * heap, refilling each run with large sequential reads, while the formatted
+ * output is written in the background from one of two alternating buffers.
+ *
+ * load_time covers chunk parsing, total_time the in-memory chunk sorts, and
+ * write_time the run spills plus the final merge.
+ */
+
+#define RUN_FILE_FORMAT OUTPUT_DIR "%s.run%d.tmp"
+#define MIN_RUN_BUFFER 4096 // Keys per run read buffer
+
+int useExternalSort(void)
+{
+    return memory_budget > 0 && N * LENGTH * 2 > memory_budget;
+}
+
+static void preadAll(int fd, char *buf, size_t size, off_t offset)
+{
+    while (size > 0)
+    {
+        ssize_t got = pread(fd, buf, size, offset);
+        if (got <= 0)
+        {
+            perror("pread run");
+            exit(EXIT_FAILURE);
+        }
+        buf += got;
+        size -= got;
+        offset += got;
+    }
+}
+
+// Parses and sorts the next chunk into `chunk`; returns how many keys it holds.
+// `window` is the byte size of the chunks, shrunk whenever lines are shorter than expected.
+static long int sortChunk(const char *method, const char **pos, const char *end, uint64_t *chunk, long int capacity,
+                          long int *window, long int remaining, double *load_time, double *sort_time)
+{
+    double startTime = omp_get_wtime();
+    const char *stop;
+    long int count;
+    for (;;)
+    {
+        stop = lineStart(*pos, end, *window);
+        count = parseLines(*pos, stop, (char *)chunk, capacity, 1, NULL);
+        if (count <= capacity || *window == 1)
+            break;
+        *window = *window * capacity / count * 63 / 64 + 1;
+    }
+    if (count > remaining)
+        count = remaining;
+    madvise((void *)input_data, stop - input_data, MADV_DONTNEED);
+    *pos = stop;
+    *load_time += omp_get_wtime() - startTime;
+
+    startTime = omp_get_wtime();
+    // Pad to the full power-of-two chunk; the padding sorts after every key.
+    for (long int i = count; i < capacity; i++)
+        chunk[i] = UINT64_MAX;
+    strings = (char *)chunk;
+    keys = chunk;
+    keys_packed = 1;
+    N = capacity;
+    if (task_threshold_auto && *sort_time == 0.0)
+        tuneTaskThreshold(method); // Calibrate once, on the first chunk
+    sort(method);
+    *sort_time += omp_get_wtime() - startTime;
+    return count;
+}
+
+// Reads `count` keys of a run starting at key `first`. Runs hold packed keys
+// as integers, or as container slots after a header of `header` bytes.
+static void readRunKeys(int fd, uint64_t *dst, long int count, long int first, off_t header)
+{
+    preadAll(fd, (char *)dst, count * sizeof(uint64_t), header + first * sizeof(uint64_t));
+    if (header > 0)
+        for (long int i = 0; i < count; i++)
+            dst[i] = toBigEndian(dst[i]);
+}
+
+// Merges the sorted runs into out_fd from byte `out_start` on, as text lines or,
+// with `binary`, as container slots. See readRunKeys() for `header`.
+static void mergeRunFiles(int runs, const int *run_fd, const long int *run_size, off_t header, long int run_buffer,
+                          int out_fd, off_t out_start, int binary)
+{
+    uint64_t *buf = (uint64_t *)malloc((size_t)runs * run_buffer * sizeof(uint64_t));
+    long int *pos = (long int *)calloc(runs, sizeof(long int)); // Keys of the run already read
+    int *len = (int *)calloc(runs, sizeof(int));
+    int *idx = (int *)calloc(runs, sizeof(int));
+    int *heap = (int *)malloc(runs * sizeof(int));
+    size_t out_size = memory_budget / 4 > (1 << 20) ? memory_budget / 4 : (1 << 20);
+    char *out[2] = {(char *)malloc(out_size), (char *)malloc(out_size)};
+    if (buf == NULL || pos == NULL || len == NULL || idx == NULL || heap == NULL || out[0] == NULL || out[1] == NULL)
+    {
+        perror("malloc merge buffers");
+        exit(EXIT_FAILURE);
+    }
+
+#define RUN_KEY(r) buf[(size_t)(r) * run_buffer + idx[r]]
+
+    int heap_size = 0;
+    for (int r = 0; r < runs; r++)
+    {
+        len[r] = run_size[r] < run_buffer ? run_size[r] : run_buffer;
+        readRunKeys(run_fd[r], buf + (size_t)r * run_buffer, len[r], 0, header);
+        pos[r] = len[r];
+        if (len[r] == 0)
+            continue;
+        // Sift up.
+        int c = heap_size++;
+        while (c > 0 && RUN_KEY(heap[(c - 1) / 2]) > RUN_KEY(r))
+        {
+            heap[c] = heap[(c - 1) / 2];
+            c = (c - 1) / 2;
+        }
+        heap[c] = r;
+    }
+
+#pragma omp parallel
+    {
+#pragma omp single
+        {
+            int cur = 0;
+            char *p = out[cur];
+            off_t offset = out_start;
+            while (heap_size > 0)
+            {
+                int r = heap[0];
+                uint64_t key = RUN_KEY(r);
+                uint64_t bytes = toBigEndian(key);
+                memcpy(p, &bytes, LENGTH);
+                if (binary)
+                {
+                    p += LENGTH;
+                }
+                else
+                {
+                    int klen = keyLength(key);
+                    p[klen] = '\n';
+                    p += klen + 1;
+                }
+
+                if (++idx[r] == len[r])
+                {
+                    long int left = run_size[r] - pos[r];
+                    len[r] = left < run_buffer ? left : run_buffer;
+                    idx[r] = 0;
+                    if (len[r] > 0)
+                        readRunKeys(run_fd[r], buf + (size_t)r * run_buffer, len[r], pos[r], header);
+                    pos[r] += len[r];
+                    if (len[r] == 0)
+                        r = heap[--heap_size]; // Run exhausted, sift the last entry down instead
+                }
+                // Sift down.
+                int c = 0;
+                for (;;)
+                {
+                    int child = 2 * c + 1;
+                    if (child >= heap_size)
+                        break;
+                    if (child + 1 < heap_size && RUN_KEY(heap[child + 1]) < RUN_KEY(heap[child]))
+                        child++;
+                    if (RUN_KEY(heap[child]) >= RUN_KEY(r))
+                        break;
+                    heap[c] = heap[child];
+                    c = child;
+                }
+                if (heap_size > 0)
+                    heap[c] = r;
+
+                if ((size_t)(p - out[cur]) > out_size - (LENGTH + 1) || heap_size == 0)
+                {
+                    // Hand the full buffer to a writer task and fill the other one meanwhile.
+                    char *full = out[cur];
+                    size_t size = p - full;
+                    off_t at = offset;
+#pragma omp taskwait
+#pragma omp task firstprivate(full, size, at)
+                    pwriteAll(out_fd, full, size, at);
+                    offset += size;
+                    cur = 1 - cur;
+                    p = out[cur];
+                }
+            }
+#pragma omp taskwait
+        }
+    }
+
+#undef RUN_KEY
+
+    free(out[0]);
+    free(out[1]);
+    free(heap);
+    free(idx);
+    free(len);
+    free(pos);
+    free(buf);
+}
+
+// Keys per chunk: the largest power of two whose chunk and auxiliary buffer fit
+// the budget, and which the in-memory sorts can still index.
+long int chunkCapacity(void)
+{
+    long int capacity = 1;
+    while (capacity * 2 * 2 * LENGTH <= memory_budget && capacity * 2 <= MAX_KEYS)
+        capacity *= 2;
+    if (capacity < MIN_RUN_BUFFER)
+    {
+        fprintf(stderr, "Memory budget of %ld bytes is too small\n", memory_budget);
+        exit(EXIT_FAILURE);
+    }
+    return capacity;
+}
+
+void externalSort(const char *input_file, const char *method, double *load_time, double *total_time,
+                  double *write_time)
+{
+    long int total = N;
+    long int capacity = chunkCapacity();
+    uint64_t *chunk = (uint64_t *)malloc(capacity * sizeof(uint64_t));
+    int max_runs = (int)((total + capacity - 1) / capacity);
+    int *run_fd = (int *)malloc(max_runs * sizeof(int));
+    long int *run_size = (long int *)malloc(max_runs * sizeof(long int));
+    long int window = capacity * LENGTH; // Lines are usually LENGTH bytes long
+    if (chunk == NULL || run_fd == NULL || run_size == NULL)
+    {
+        perror("malloc external sort");
+        exit(EXIT_FAILURE);
+    }
+    const char *name = strrchr(input_file, '/') ? strrchr(input_file, '/') + 1 : input_file;
+
+    // Run formation.
+    packed_mode = 1;
+    *load_time = *total_time = *write_time = 0.0;
+    const char *pos = input_body, *end = input_data + input_size;
+    long int sorted = 0;
+    int runs = 0;
+    while (sorted < total && pos < end)
+    {
+        long int count = sortChunk(method, &pos, end, chunk, capacity, &window, total - sorted, load_time, total_time);
+
+        double startTime = omp_get_wtime();
+        if (runs == max_runs)
+        {
+            // Short lines give more, smaller chunks than estimated.
+            max_runs *= 2;
+            run_fd = (int *)realloc(run_fd, max_runs * sizeof(int));
+            run_size = (long int *)realloc(run_size, max_runs * sizeof(long int));
+            if (run_fd == NULL || run_size == NULL)
+            {
+                perror("realloc runs");
+                exit(EXIT_FAILURE);
+            }
+        }
+        char run_file[256];
+        snprintf(run_file, sizeof(run_file), RUN_FILE_FORMAT, name, runs);
+        run_fd[runs] = open(run_file, O_RDWR | O_CREAT | O_TRUNC, 0600);
+        if (run_fd[runs] < 0)
+        {
+            perror("open run file");
+            exit(EXIT_FAILURE);
+        }
+        unlink(run_file); // Removed once closed
+        pwriteAll(run_fd[runs], (const char *)chunk, count * sizeof(uint64_t), 0);
+        posix_fadvise(run_fd[runs], 0, 0, POSIX_FADV_SEQUENTIAL);
+        run_size[runs++] = count;
+        sorted += count;
+        *write_time += omp_get_wtime() - startTime;
+    }
+    free(chunk);
+    strings = NULL;
+    keys = NULL;
+    N = total;
+    if (sorted < total)
+    {
+        fprintf(stderr, "Input file %s has %ld elements, expected %ld\n", input_file, sorted, total);
+        exit(EXIT_FAILURE);
+    }
+
+    // Merge, using the half of the budget for run reads.
+    double startTime = omp_get_wtime();
+    long int run_buffer = memory_budget / 2 / runs / sizeof(uint64_t);
+    if (run_buffer < MIN_RUN_BUFFER)
+        run_buffer = MIN_RUN_BUFFER;
+    if (run_buffer > MAX_KEYS)
+        run_buffer = MAX_KEYS; // Buffer fill counts are int
+    mergeRunFiles(runs, run_fd, run_size, 0, run_buffer, fout, 0, 0);
+    *write_time += omp_get_wtime() - startTime;
+
+    for (int r = 0; r < runs; r++)
+        close(run_fd[r]);
+    free(run_size);
+    free(run_fd);
+}
+
+/*
+ * Incremental sorted store ("-append store", "-query store", "-compact store").
+ *
+ * A store is a directory under OUTPUT_DIR holding sorted runs, each a binary
+ * container, and a MANIFEST listing the live runs with their tier. -append
+ * sorts the input as a new batch with the selected method and commits it as a
+ * run of tier 0, so its cost depends on the batch alone. Whenever a tier holds
+ * STORE_FANOUT runs, a "-compact" process started in the background merges
+ * them into one run of the next tier, so that every key is rewritten once per
+ * tier, as in a tiered LSM tree. -query merges the live runs into one sorted
+ * output. Both merges stream the runs through the heap merge of the external
+ * sort, so neither is bounded by memory or by the in-memory key limit.
+ *
+ * The manifest is replaced with rename() under an exclusive lock of the LOCK
+ * file. Compaction takes that lock only to read and commit the manifest, not
+ * while merging, and deletes its input runs after the commit. A query opens
+ * its runs under a shared lock, so it reads a consistent snapshot even if they
+ * are deleted meanwhile. Run files left by a crash before their commit are
+ * not in the manifest and are ignored.
+ */
+
+#define STORE_FANOUT 4
+#define STORE_MAX_RUNS 1024
+#define STORE_LOCK_FILE "LOCK"
+#define STORE_COMPACT_FILE "COMPACT" // Held by the running compaction
+#define STORE_MANIFEST_FILE "MANIFEST"
+#define STORE_MERGE_BUFFER (64 << 20) // Bytes of run read buffers per merge
+
+typedef struct
+{
+    int tier;
+    long int seq; // Names the run file, see runPath()
+    long int count;
+    int fd; // Open run file while it is merged
+} StoreRun;
+
+typedef struct
+{
+    long int next_seq;
+    int runs;
+    StoreRun run[STORE_MAX_RUNS];
+} StoreManifest;
+
+extern char **environ;
+
+static void runPath(char *path, size_t size, long int seq)
+{
+    snprintf(path, size, "%s/run-%ld.bin", store_dir, seq);
+}
+
+// Opens and flock()s one of the store's lock files; returns -1 if LOCK_NB finds it taken.
+static int lockStore(const char *name, int operation)
+{
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s", store_dir, name);
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+    {
+        perror("open store lock");
+        fprintf(stderr, "Error opening store: %s\n", store_dir);
+        exit(EXIT_FAILURE);
+    }
+    if (flock(fd, operation) < 0)
+    {
+        if (errno != EWOULDBLOCK)
+        {
+            perror("flock store");
+            exit(EXIT_FAILURE);
+        }
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void readManifest(StoreManifest *manifest)
+{
+    char path[512];
+    snprintf(path, sizeof(path), "%s/" STORE_MANIFEST_FILE, store_dir);
+    manifest->next_seq = 0;
+    manifest->runs = 0;
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+        return; // A new store
+    if (fscanf(f, "%ld", &manifest->next_seq) != 1)
+    {
+        fprintf(stderr, "Store manifest %s is corrupt\n", path);
+        exit(EXIT_FAILURE);
+    }
+    StoreRun run = {0};
+    while (fscanf(f, "%d %ld %ld", &run.tier, &run.seq, &run.count) == 3)
+    {
+        if (manifest->runs == STORE_MAX_RUNS)
+        {
+            fprintf(stderr, "Store %s has more than %d runs\n", store_dir, STORE_MAX_RUNS);
+            exit(EXIT_FAILURE);
+        }
+        manifest->run[manifest->runs++] = run;
+    }
+    fclose(f);
+}
+
+// Replaces the manifest durably: a synced temporary file renamed over it.
+static void writeManifest(const StoreManifest *manifest)
+{
+    char path[512], tmp[512];
+    snprintf(path, sizeof(path), "%s/" STORE_MANIFEST_FILE, store_dir);
+    snprintf(tmp, sizeof(tmp), "%s/" STORE_MANIFEST_FILE ".tmp", store_dir);
+    FILE *f = fopen(tmp, "w");
+    if (f == NULL)
+    {
+        perror("open store manifest");
+        exit(EXIT_FAILURE);
+    }
+    fprintf(f, "%ld\n", manifest->next_seq);
+    for (int r = 0; r < manifest->runs; r++)
+        fprintf(f, "%d %ld %ld\n", manifest->run[r].tier, manifest->run[r].seq, manifest->run[r].count);
+    if (fflush(f) != 0 || fsync(fileno(f)) < 0 || fclose(f) != 0 || rename(tmp, path) < 0)
+    {
+        perror("write store manifest");
+        exit(EXIT_FAILURE);
+    }
+    int dir = open(store_dir, O_RDONLY | O_DIRECTORY);
+    if (dir >= 0)
+    {
+        fsync(dir); // Persists the rename and the new run files
+        close(dir);
+    }
+}
+
+// Writes the N sorted keys as run `seq` and syncs it.
+static void writeRun(long int seq)
+{
+    char path[512];
+    runPath(path, sizeof(path), seq);
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        perror("open store run");
+        exit(EXIT_FAILURE);
+    }
+    writeContainer(fd, N);
+    if (fsync(fd) < 0)
+    {
+        perror("fsync store run");
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+}
+
+static void openRun(StoreRun *run)
+{
+    char path[512];
+    runPath(path, sizeof(path), run->seq);
+    run->fd = open(path, O_RDONLY);
+    struct stat st;
+    BinaryHeader header;
+    if (run->fd < 0 || fstat(run->fd, &st) < 0)
+    {
+        perror("open store run");
+        fprintf(stderr, "Error opening store run: %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    if ((size_t)st.st_size < sizeof(header) + run->count * LENGTH ||
+        pread(run->fd, &header, sizeof(header), 0) != sizeof(header) ||
+        memcmp(header.magic, BINARY_MAGIC, sizeof(header.magic)) != 0 || header.key_width != LENGTH ||
+        (long int)header.count != run->count)
+    {
+        fprintf(stderr, "Store run %s does not match the manifest\n", path);
+        exit(EXIT_FAILURE);
+    }
+    posix_fadvise(run->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+}
+
+// Streams the merge of open runs into fd as a binary container, or as text.
+// Returns the number of keys written.
+static long int mergeStoreRuns(const StoreRun *run, int runs, int fd, int binary)
+{
+    int *run_fd = (int *)malloc(runs * sizeof(int));
+    long int *run_size = (long int *)malloc(runs * sizeof(long int));
+    if (run_fd == NULL || run_size == NULL)
+    {
+        perror("malloc store merge");
+        exit(EXIT_FAILURE);
+    }
+    long int count = 0;
+    for (int r = 0; r < runs; r++)
+    {
+        run_fd[r] = run[r].fd;
+        run_size[r] = run[r].count;
+        count += run[r].count;
+    }
+
+    off_t start = 0;
+    if (binary)
+    {
+        BinaryHeader header = {BINARY_MAGIC, BINARY_VERSION, LENGTH, 1, 0, count};
+        pwriteAll(fd, (const char *)&header, sizeof(header), 0);
+        start = sizeof(header);
+    }
+    long int run_buffer = STORE_MERGE_BUFFER / runs / sizeof(uint64_t);
+    if (run_buffer < MIN_RUN_BUFFER)
+        run_buffer = MIN_RUN_BUFFER;
+    mergeRunFiles(runs, run_fd, run_size, sizeof(BinaryHeader), run_buffer, fd, start, binary);
+
+    free(run_size);
+    free(run_fd);
+    return count;
+}
+
+static void closeRuns(StoreRun *run, int runs)
+{
+    for (int r = 0; r < runs; r++)
+        close(run[r].fd);
+}
+
+// Returns the lowest tier holding STORE_FANOUT runs, or -1.
+static int fullTier(const StoreManifest *manifest)
+{
+    for (int tier = 0;; tier++)
+    {
+        int runs = 0, higher = 0;
+        for (int r = 0; r < manifest->runs; r++)
+        {
+            runs += manifest->run[r].tier == tier;
+            higher += manifest->run[r].tier > tier;
+        }
+        if (runs >= STORE_FANOUT)
+            return tier;
+        if (higher == 0)
+            return -1;
+    }
+}
+
+// Runs "-compact" on the store in a detached process, with its output discarded.
+static void startCompaction(void)
+{
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+    char *args[] = {"sort", "-compact", (char *)store_name, NULL};
+    pid_t pid;
+    if (posix_spawn(&pid, "/proc/self/exe", &actions, NULL, args, environ) != 0)
+        fprintf(stderr, "Could not start compacting %s, it is retried on the next append\n", store_dir);
+    posix_spawn_file_actions_destroy(&actions);
+}
+
+void appendToStore(const char *input_file, const char *method, double *load_time, double *total_time,
+                   double *write_time)
+{
+    if (mkdir(store_dir, 0755) < 0 && errno != EEXIST)
+    {
+        perror("mkdir store");
+        exit(EXIT_FAILURE);
+    }
+
+    double startTime = omp_get_wtime();
+    mapInput(input_file);
+    loadInput(input_file, 1, requiresPowerOfTwo(method), 0);
+    unmapInput();
+    *load_time = omp_get_wtime() - startTime;
+
+    if (task_threshold_auto)
+        tuneTaskThreshold(method);
+    startTime = omp_get_wtime();
+    if (!input_sorted)
+        sort(method);
+    *total_time = omp_get_wtime() - startTime;
+
+    startTime = omp_get_wtime();
+    StoreManifest manifest;
+    int lock = lockStore(STORE_LOCK_FILE, LOCK_EX);
+    readManifest(&manifest);
+    if (manifest.runs == STORE_MAX_RUNS)
+    {
+        fprintf(stderr, "Store %s has %d runs, compaction is falling behind\n", store_dir, STORE_MAX_RUNS);
+        exit(EXIT_FAILURE);
+    }
+    StoreRun run = {0, manifest.next_seq++, N, -1};
+    writeRun(run.seq);
+    manifest.run[manifest.runs++] = run;
+    writeManifest(&manifest);
+    close(lock);
+    *write_time = omp_get_wtime() - startTime;
+
+    if (fullTier(&manifest) >= 0)
+        startCompaction();
+}
+
+// Merges full tiers until none is left. load_time covers opening the runs and
+// write_time the streamed merges and manifest commits; nothing is sorted.
+void compactStore(double *load_time, double *total_time, double *write_time)
+{
+    *load_time = *total_time = *write_time = 0.0;
+    int compacting = lockStore(STORE_COMPACT_FILE, LOCK_EX | LOCK_NB);
+    if (compacting < 0)
+        return; // The running compaction picks up the new runs
+
+    for (;;)
+    {
+        double startTime = omp_get_wtime();
+        StoreManifest manifest;
+        StoreRun run[STORE_FANOUT * 4];
+        int lock = lockStore(STORE_LOCK_FILE, LOCK_EX);
+        readManifest(&manifest);
+        int tier = fullTier(&manifest);
+        if (tier < 0)
+        {
+            // Let go of the compaction before the manifest: an append that
+            // fills a tier after this check then finds it free to start one.
+            close(compacting);
+            close(lock);
+            return;
+        }
+        int runs = 0;
+        for (int r = 0; r < manifest.runs && runs < STORE_FANOUT * 4; r++)
+            if (manifest.run[r].tier == tier)
+                run[runs++] = manifest.run[r];
+        long int seq = manifest.next_seq++; // Reserved now, appends may commit meanwhile
+        writeManifest(&manifest);
+        close(lock);
+        for (int r = 0; r < runs; r++)
+            openRun(&run[r]);
+        *load_time += omp_get_wtime() - startTime;
+
+        startTime = omp_get_wtime();
+        char path[512];
+        runPath(path, sizeof(path), seq);
+        int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+        {
+            perror("open store run");
+            exit(EXIT_FAILURE);
+        }
+        N = mergeStoreRuns(run, runs, fd, 1);
+        if (fsync(fd) < 0)
+        {
+            perror("fsync store run");
+            exit(EXIT_FAILURE);
+        }
+        close(fd);
+        closeRuns(run, runs);
+
+        lock = lockStore(STORE_LOCK_FILE, LOCK_EX);
+        readManifest(&manifest);
+        int kept = 0;
+        for (int r = 0; r < manifest.runs; r++)
+        {
+            int merged = 0;
+            for (int m = 0; m < runs; m++)
+                merged |= manifest.run[r].seq == run[m].seq;
+            if (!merged)
+                manifest.run[kept++] = manifest.run[r];
+        }
+        manifest.run[kept] = (StoreRun){tier + 1, seq, N, -1};
+        manifest.runs = kept + 1;
+        writeManifest(&manifest);
+        close(lock);
+        for (int r = 0; r < runs; r++)
+        {
+            runPath(path, sizeof(path), run[r].seq);
+            unlink(path);
+        }
+        *write_time += omp_get_wtime() - startTime;
+    }
+}
 
+// Writes the merged view of the store's runs. As with -mem, the streamed merge
+// counts as write time.
+void queryStore(double *load_time, double *total_time, double *write_time)
+{
     double startTime = omp_get_wtime();
-    sort(sort_method);
-    double total_time = omp_get_wtime() - startTime;
+    StoreManifest manifest;
+    int lock = lockStore(STORE_LOCK_FILE, LOCK_SH);
+    readManifest(&manifest);
+    if (manifest.runs == 0)
+    {
+        fprintf(stderr, "Store %s is empty\n", store_dir);
+        exit(EXIT_FAILURE);
+    }
+    for (int r = 0; r < manifest.runs; r++)
+        openRun(&manifest.run[r]);
+    close(lock);
+    *load_time = omp_get_wtime() - startTime;
+    *total_time = 0.0;
+
+    startTime = omp_get_wtime();
+    N = mergeStoreRuns(manifest.run, manifest.runs, fout, output_binary);
+    closeRuns(manifest.run, manifest.runs);
+    *write_time = omp_get_wtime() - startTime;
+}
+
+#define STATS_CSV_HEADER                                                                                               \
+    ",tasks_spawned,tasks_executed,tasks_executed_min,tasks_executed_max,compares,swaps,merge_time,recursion_time,"   \
+    "load_instructions,load_cache_misses,sort_instructions,sort_cache_misses,write_instructions,write_cache_misses"
+
+// Prints the -stats columns, or a per-thread report outside CSV mode. merge_time
+// and recursion_time are thread-seconds: the time all threads spent in merge
+// kernels, and the rest of threads * total_time (recursion, task overhead, idling).
+void printStats(double total_time)
+{
+    ThreadStats sum = {0};
+    long int min_executed = -1, max_executed = 0;
+    int slots = stats_slots < STATS_MAX_THREADS ? stats_slots : STATS_MAX_THREADS;
+    for (int t = 0; t < slots; t++)
+    {
+        sum.tasks_spawned += thread_stats[t].tasks_spawned;
+        sum.tasks_executed += thread_stats[t].tasks_executed;
+        sum.compares += thread_stats[t].compares;
+        sum.swaps += thread_stats[t].swaps;
+        sum.merge_time += thread_stats[t].merge_time;
+        if (min_executed < 0 || thread_stats[t].tasks_executed < min_executed)
+            min_executed = thread_stats[t].tasks_executed;
+        if (thread_stats[t].tasks_executed > max_executed)
+            max_executed = thread_stats[t].tasks_executed;
+    }
+    if (min_executed < 0)
+        min_executed = 0;
+    double recursion_time = omp_get_max_threads() * total_time - sum.merge_time;
+
+    if (csv_mode)
+    {
+        printf(",%ld,%ld,%ld,%ld,%ld,%ld,%.6lf,%.6lf", sum.tasks_spawned, sum.tasks_executed, min_executed,
+               max_executed, sum.compares, sum.swaps, sum.merge_time, recursion_time);
+        for (int phase = 0; phase < PHASES; phase++)
+            printf(",%lld,%lld", phase_counter[phase][0], phase_counter[phase][1]);
+        return;
+    }
+
+    static const char *phase_name[PHASES] = {"Load", "Sort", "Write"};
+    for (int t = 0; t < slots; t++)
+        printf("Thread %d: %ld tasks spawned, %ld executed, %ld compares, %ld swaps, %.6lf s merging\n", t,
+               thread_stats[t].tasks_spawned, thread_stats[t].tasks_executed, thread_stats[t].compares,
+               thread_stats[t].swaps, thread_stats[t].merge_time);
+    printf("Tasks = %ld spawned, %ld executed (%ld to %ld per thread)\n", sum.tasks_spawned, sum.tasks_executed,
+           min_executed, max_executed);
+    printf("Compares = %ld, swaps = %ld\n", sum.compares, sum.swaps);
+    printf("Merge time = %.6lf thread-seconds, recursion time = %.6lf thread-seconds\n", sum.merge_time,
+           recursion_time);
+    for (int phase = 0; phase < PHASES; phase++)
+        printf("%s: %lld instructions, %lld cache misses\n", phase_name[phase], phase_counter[phase][0],
+               phase_counter[phase][1]);
+}
+
+#ifndef SORT_NO_MAIN
+int main(int argc, char **argv)
+{
+    char input_file[256] = INPUT_DIR DEFAULT_INPUT_FILE;
+    char sort_method[32] = ""; // Set by -sort, or defaulted below
+
+    parseCommandLineArguments(argc, argv, input_file, sort_method);
+    if (sort_method[0] == '\0') // The bitonic sorts need fixed-width keys
+        snprintf(sort_method, sizeof(sort_method), "%s", varlen_mode ? "mergesort_parallel" : "bitonic_parallel");
+
+    if (store_mode != STORE_NONE)
+    {
+        if (varlen_mode || memory_budget > 0 || argsort_mode != ARGSORT_NONE || topk > 0 || uniq_mode ||
+            bench_repetitions > 0)
+        {
+            fprintf(stderr, "-append, -query and -compact cannot be combined with -varlen, -mem, -argsort, -topk, "
+                            "-uniq or -bench\n");
+            exit(EXIT_FAILURE);
+        }
+        snprintf(store_dir, sizeof(store_dir), OUTPUT_DIR "%s", store_name);
+        packed_mode = 1; // Runs hold packed keys
+    }
+
+    if (bench_repetitions > 0)
+    {
+        // The benchmark writes no output and collects no statistics.
+        if (varlen_mode || memory_budget > 0 || argsort_mode != ARGSORT_NONE || topk > 0 || uniq_mode ||
+            output_binary || stats_mode || validate_mode)
+        {
+            fprintf(stderr, "-bench cannot be combined with -varlen, -mem, -argsort, -topk, -uniq, -binary, -stats "
+                            "or -validate\n");
+            exit(EXIT_FAILURE);
+        }
+        runBenchmark(input_file, sort_method);
+        freeBuffer(strings, N * LENGTH);
+        return EXIT_SUCCESS;
+    }
+
+    if (output_binary && (varlen_mode || memory_budget > 0 || argsort_mode != ARGSORT_NONE))
+    {
+        fprintf(stderr, "-binary cannot be combined with -varlen, -mem or -argsort\n");
+        exit(EXIT_FAILURE);
+    }
+    if (topk > 0 && (varlen_mode || memory_budget > 0 || argsort_mode != ARGSORT_NONE))
+    {
+        fprintf(stderr, "-topk cannot be combined with -varlen, -mem or -argsort\n");
+        exit(EXIT_FAILURE);
+    }
+    if (uniq_mode && (varlen_mode || memory_budget > 0 || argsort_mode != ARGSORT_NONE || topk > 0 || output_binary))
+    {
+        fprintf(stderr, "-uniq cannot be combined with -varlen, -mem, -argsort, -topk or -binary\n");
+        exit(EXIT_FAILURE);
+    }
+    if (uniq_mode)
+        packed_mode = 1; // Runs are counted on packed keys
+    if (validate_mode && (varlen_mode || memory_budget > 0 || argsort_mode != ARGSORT_NONE || topk > 0 || uniq_mode ||
+                          store_mode != STORE_NONE))
+    {
+        fprintf(stderr, "-validate cannot be combined with -varlen, -mem, -argsort, -topk, -uniq or a store\n");
+        exit(EXIT_FAILURE);
+    }
+    if (stats_mode && (varlen_mode || memory_budget > 0))
+    {
+        fprintf(stderr, "-stats cannot be combined with -varlen or -mem\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (store_mode == STORE_QUERY)
+        openfiles(store_dir);
+    else if (store_mode == STORE_NONE)
+        openfiles(input_file);
+    if (stats_mode)
+        openPerfCounters();
+
+    double load_time, total_time, write_time, validate_time = 0.0;
+    if (store_mode == STORE_APPEND)
+    {
+        appendToStore(input_file, sort_method, &load_time, &total_time, &write_time);
+    }
+    else if (store_mode == STORE_QUERY)
+    {
+        queryStore(&load_time, &total_time, &write_time);
+    }
+    else if (store_mode == STORE_COMPACT)
+    {
+        compactStore(&load_time, &total_time, &write_time);
+    }
+    else if (varlen_mode)
+    {
+        if (argsort_mode != ARGSORT_NONE || memory_budget > 0 || packed_mode || task_threshold_auto)
+        {
+            fprintf(stderr, "-varlen cannot be combined with -argsort, -mem, -packed or -t auto\n");
+            exit(EXIT_FAILURE);
+        }
+        sortVarlen(input_file, sort_method, &load_time, &total_time, &write_time);
+    }
+    else
+    {
+        mapInput(input_file);
+        if (input_binary && (memory_budget > 0 || argsort_mode == ARGSORT_RECORDS))
+        {
+            fprintf(stderr, "Binary input cannot be combined with -mem or -argsort records\n");
+            exit(EXIT_FAILURE);
+        }
+        if (useExternalSort())
+        {
+            if (argsort_mode != ARGSORT_NONE)
+            {
+                fprintf(stderr, "-argsort is not available with -mem\n");
+                exit(EXIT_FAILURE);
+            }
+            externalSort(input_file, sort_method, &load_time, &total_time, &write_time);
+            unmapInput();
+        }
+        else
+        {
+            startPhase();
+            double loadStartTime = omp_get_wtime();
+            loadInput(input_file, usesPackedKeys(sort_method) || argsort_mode != ARGSORT_NONE || topk > 0,
+                      requiresPowerOfTwo(sort_method) && topk == 0, argsort_mode == ARGSORT_RECORDS);
+            if (argsort_mode != ARGSORT_RECORDS)
+                unmapInput(); // Records are gathered from the mapping at output time
+            load_time = omp_get_wtime() - loadStartTime;
+            endPhase(PHASE_LOAD);
+
+            uint64_t input_hash = 0;
+            double validateStartTime = omp_get_wtime();
+            if (validate_mode)
+                input_hash = multisetHash();
+            validate_time = omp_get_wtime() - validateStartTime;
+
+            if (task_threshold_auto && topk == 0)
+                tuneTaskThreshold(sort_method);
+
+            memset(thread_stats, 0, sizeof(thread_stats)); // Drop anything counted while tuning
+            startPhase();
+            double startTime = omp_get_wtime();
+            if (argsort_mode != ARGSORT_NONE)
+                sortPairs(sort_method);
+            else if (topk > 0)
+                selectTopK(topk);
+            else if (!input_sorted) // A sorted binary input is written back as is
+                sort(sort_method);
+            total_time = omp_get_wtime() - startTime;
+            endPhase(PHASE_SORT);
+
+            validateStartTime = omp_get_wtime();
+            if (validate_mode)
+                validateOutput(input_hash);
+            validate_time += omp_get_wtime() - validateStartTime;
+
+            startPhase();
+            double writeStartTime = omp_get_wtime();
+            if (argsort_mode != ARGSORT_NONE)
+                writeArgsortOutput();
+            else if (topk > 0)
+                writeKeys(topk < N ? topk : N);
+            else if (uniq_mode)
+                writeUniqOutput();
+            else
+                writeOutput();
+            write_time = omp_get_wtime() - writeStartTime;
+            endPhase(PHASE_WRITE);
+
+            if (argsort_mode == ARGSORT_RECORDS)
+                unmapInput();
+        }
+    }
 
     if (csv_mode)
     {
         int omp_threads = omp_get_max_threads();
-        printf("input_file,N,task_threshold,omp_num_threads,total_time\n");
-        printf("%s,%ld,%d,%d,%.6lf\n", input_file, N, task_threshold, omp_threads, total_time);
+        printf("input_file,N,task_threshold,omp_num_threads,total_time,load_time,write_time%s%s\n",
+               validate_mode ? ",validate_time" : "", stats_mode ? STATS_CSV_HEADER : "");
+        printf("%s,%ld,%d,%d,%.6lf,%.6lf,%.6lf", input_file, N, task_threshold, omp_threads, total_time, load_time,
+               write_time);
+        if (validate_mode)
+            printf(",%.6lf", validate_time);
+        if (stats_mode)
+            printStats(total_time);
+        printf("\n");
     }
     else
     {
+        if (task_threshold_auto)
+            printf("Task threshold = %d (auto)\n", task_threshold);
+        printf("Load time = %.6lf seconds\n", load_time);
         printf("Total time = %.6lf seconds\n", total_time);
+        printf("Write time = %.6lf seconds\n", write_time);
+        if (validate_mode)
+            printf("Validate time = %.6lf seconds (output valid)\n", validate_time);
+        if (stats_mode)
+            printStats(total_time);
     }
+    if (stats_mode)
+        closePerfCounters();
 
-    for (i = 0; i < N; i++)
-        fprintf(fout, "%s\n", strings + (i * LENGTH));
-
-    free(strings);
+    freeBuffer(strings, N * LENGTH);
+    free(pairs);
+    free(record_start);
+    free(distinct_keys);
     closefiles();
     return EXIT_SUCCESS;
 }
+#endif
@@ -0,0 +1,369 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <mpi.h>
+#include <omp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "sort.h"
+
+/*
+ * Hybrid MPI+OpenMP sort.
+ *
+ * Every rank maps the input, parses the lines of its share of the file (cut at
+ * line boundaries) into packed keys and sorts them with one of the OpenMP
+ * methods of sort.c. Global splitters are chosen by regular sampling: each
+ * rank contributes evenly spaced keys of its sorted slice, and every rank
+ * picks the same splitters out of the gathered samples. One MPI_Alltoallv
+ * sends each key range to its rank, which merges the sorted runs it received.
+ * The output is the concatenation of the ranks' results in rank order,
+ * written by every rank at its own offset, either with pwrite on a shared
+ * file system or with MPI-IO ("-mpiio").
+ */
+
+#define OUTPUT_DIR "output/"
+#define INPUT_DIR "data/"
+#define DEFAULT_INPUT_FILE "in_16777216.in"
+#define MPIIO_CHUNK (1 << 30) // Bytes per MPI_File_write_at_all call, below INT_MAX
+
+static int rank = 0;
+static int ranks = 1;
+static int mpiio_mode = 0;
+
+static void parseCommandLineArguments(int argc, char **argv, char *input_file, char *sort_method)
+{
+    for (int arg = 1; arg < argc; arg++)
+    {
+        if (strcmp(argv[arg], "-i") == 0 && arg + 1 < argc)
+        {
+            snprintf(input_file, 256, INPUT_DIR "%s", argv[arg + 1]);
+            arg++;
+        }
+        else if (strcmp(argv[arg], "-t") == 0 && arg + 1 < argc)
+        {
+            task_threshold = atoi(argv[arg + 1]);
+            arg++;
+        }
+        else if (strcmp(argv[arg], "-csv") == 0)
+        {
+            csv_mode = 1;
+        }
+        else if (strcmp(argv[arg], "-mpiio") == 0)
+        {
+            mpiio_mode = 1;
+        }
+        else if (strcmp(argv[arg], "-sort") == 0 && arg + 1 < argc)
+        {
+            snprintf(sort_method, 32, "%s", argv[arg + 1]);
+            arg++;
+        }
+        else
+        {
+            if (rank == 0)
+                fprintf(stderr, "Usage: %s [-i input_file] [-t task_threshold] [-csv] [-mpiio] [-sort method]\n",
+                        argv[0]);
+            MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+        }
+    }
+}
+
+// Parses this rank's share of the first `total` input lines into packed keys.
+void loadSlice(const char *input_file, long int *total)
+{
+    mapInput(input_file);
+    *total = N;
+    if (*total < 1)
+    {
+        if (rank == 0)
+            fprintf(stderr, "%ld is not a valid number: must be positive!\n", *total);
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+    const char *end = input_data + input_size;
+    long int body_size = end - input_body;
+    const char *from = lineStart(input_body, end, body_size * rank / ranks);
+    const char *to = lineStart(input_body, end, body_size * (rank + 1) / ranks);
+
+    // Lines past the header count are ignored, as in sort.c
+    long int lines = parseLines(from, to, NULL, 0, 1, NULL);
+    long int before = 0, all = 0;
+    MPI_Exscan(&lines, &before, 1, MPI_LONG, MPI_SUM, MPI_COMM_WORLD);
+    MPI_Allreduce(&lines, &all, 1, MPI_LONG, MPI_SUM, MPI_COMM_WORLD);
+    if (rank == 0)
+        before = 0; // MPI_Exscan leaves rank 0 undefined
+    if (all < *total)
+    {
+        if (rank == 0)
+            fprintf(stderr, "Input file %s has %ld elements, expected %ld\n", input_file, all, *total);
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+    long int n = *total - before;
+    n = n < 0 ? 0 : (n < lines ? n : lines);
+    if (n > MAX_KEYS)
+    {
+        fprintf(stderr, "Rank %d holds %ld keys, more than %ld; use more ranks\n", rank, n, MAX_KEYS);
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+
+    strings = (char *)allocBuffer((n > 0 ? n : 1) * LENGTH);
+    if (strings == NULL)
+    {
+        perror("malloc strings");
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+    parseLines(from, to, strings, n, 1, NULL);
+    unmapInput();
+    keys = (uint64_t *)strings;
+    keys_packed = 1;
+    N = n;
+}
+
+// First index of the sorted keys greater than `key`.
+static long int upperBound(const uint64_t *data, long int n, uint64_t key)
+{
+    long int lo = 0, hi = n;
+    while (lo < hi)
+    {
+        long int mid = lo + (hi - lo) / 2;
+        if (data[mid] <= key)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+// Sends every key to the rank owning its range and merges the received runs
+// into `keys`, replacing the local slice.
+void exchangeKeys(void)
+{
+    uint64_t *samples = (uint64_t *)malloc(ranks * sizeof(uint64_t));
+    uint64_t *all_samples = (uint64_t *)malloc((size_t)ranks * ranks * sizeof(uint64_t));
+    int *send_count = (int *)malloc(ranks * sizeof(int));
+    int *send_displ = (int *)malloc(ranks * sizeof(int));
+    int *recv_count = (int *)malloc(ranks * sizeof(int));
+    int *recv_displ = (int *)malloc((ranks + 1) * sizeof(int));
+    if (samples == NULL || all_samples == NULL || send_count == NULL || send_displ == NULL || recv_count == NULL ||
+        recv_displ == NULL)
+    {
+        perror("malloc exchange");
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+
+    // An empty slice samples the largest key, which only pushes splitters up.
+    for (int r = 0; r < ranks; r++)
+        samples[r] = N > 0 ? keys[N * (r + 1) / (ranks + 1)] : UINT64_MAX;
+    MPI_Allgather(samples, ranks, MPI_UINT64_T, all_samples, ranks, MPI_UINT64_T, MPI_COMM_WORLD);
+    qsort(all_samples, (size_t)ranks * ranks, sizeof(uint64_t), compareUint64);
+
+    // Send counts and displacements fit in int, as N <= MAX_KEYS (see loadSlice).
+    long int start = 0;
+    for (int r = 0; r < ranks; r++)
+    {
+        long int stop = r == ranks - 1 ? N : upperBound(keys, N, all_samples[(size_t)(r + 1) * ranks]);
+        stop = stop < start ? start : stop;
+        send_displ[r] = (int)start;
+        send_count[r] = (int)(stop - start);
+        start = stop;
+    }
+    MPI_Alltoall(send_count, 1, MPI_INT, recv_count, 1, MPI_INT, MPI_COMM_WORLD);
+    long int received = 0;
+    for (int r = 0; r < ranks; r++)
+        received += recv_count[r];
+    if (received > MAX_KEYS)
+    {
+        // Neither the receive displacements nor the merge indices would fit in int.
+        fprintf(stderr, "Rank %d would receive %ld keys, more than %ld; use more ranks\n", rank, received, MAX_KEYS);
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+    recv_displ[0] = 0;
+    for (int r = 0; r < ranks; r++)
+        recv_displ[r + 1] = recv_displ[r] + recv_count[r];
+
+    size_t bytes = (received > 0 ? received : 1) * sizeof(uint64_t);
+    uint64_t *from = (uint64_t *)allocBuffer(bytes);
+    uint64_t *to = (uint64_t *)allocBuffer(bytes);
+    if (from == NULL || to == NULL)
+    {
+        perror("malloc exchange buffers");
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+    MPI_Alltoallv(keys, send_count, send_displ, MPI_UINT64_T, from, recv_count, recv_displ, MPI_UINT64_T,
+                  MPI_COMM_WORLD);
+    freeBuffer(strings, (N > 0 ? N : 1) * LENGTH);
+
+    // Pairwise merge rounds over the received runs, ping-ponging between buffers
+    for (int span = 1; span < ranks; span *= 2)
+    {
+#pragma omp parallel
+        {
+#pragma omp single
+            {
+                for (int r = 0; r < ranks; r += 2 * span)
+                {
+                    int low = recv_displ[r];
+                    int mid = recv_displ[r + span < ranks ? r + span : ranks];
+                    int high = recv_displ[r + 2 * span < ranks ? r + 2 * span : ranks];
+                    if (mid < high)
+                        mergeKeysParallel(from, to, low, mid, high);
+                    else
+                        memcpy(to + low, from + low, (high - low) * sizeof(uint64_t));
+                }
+            }
+        }
+        uint64_t *swap = from;
+        from = to;
+        to = swap;
+    }
+    freeBuffer(to, bytes);
+
+    strings = (char *)from;
+    keys = from;
+    N = received;
+
+    free(recv_displ);
+    free(recv_count);
+    free(send_displ);
+    free(send_count);
+    free(all_samples);
+    free(samples);
+}
+
+void writeSlice(const char *output_file)
+{
+    long int size = outputSize();
+    long int offset = 0, total = 0;
+    MPI_Exscan(&size, &offset, 1, MPI_LONG, MPI_SUM, MPI_COMM_WORLD);
+    MPI_Allreduce(&size, &total, 1, MPI_LONG, MPI_SUM, MPI_COMM_WORLD);
+    if (rank == 0)
+        offset = 0;
+
+    if (mpiio_mode)
+    {
+        char *buf = (char *)malloc(size > 0 ? size : 1);
+        if (buf == NULL)
+        {
+            perror("malloc output buffer");
+            MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+        }
+        formatOutput(buf);
+
+        MPI_File file;
+        if (MPI_File_open(MPI_COMM_WORLD, output_file, MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL, &file) !=
+            MPI_SUCCESS)
+        {
+            fprintf(stderr, "Error opening output file: %s\n", output_file);
+            MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+        }
+        MPI_File_set_size(file, total);
+
+        // Collective writes need the same number of calls on every rank
+        long int chunks = (size + MPIIO_CHUNK - 1) / MPIIO_CHUNK, max_chunks = 0;
+        MPI_Allreduce(&chunks, &max_chunks, 1, MPI_LONG, MPI_MAX, MPI_COMM_WORLD);
+        for (long int c = 0; c < max_chunks; c++)
+        {
+            long int at = c * (long int)MPIIO_CHUNK;
+            int count = at < size ? (int)(size - at < MPIIO_CHUNK ? size - at : MPIIO_CHUNK) : 0;
+            MPI_File_write_at_all(file, offset + (at < size ? at : 0), buf + (at < size ? at : 0), count, MPI_BYTE,
+                                  MPI_STATUS_IGNORE);
+        }
+        MPI_File_close(&file);
+        free(buf);
+        return;
+    }
+
+    // Rank 0 creates and sizes the file before anybody writes into it
+    if (rank == 0)
+    {
+        fout = open(output_file, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fout < 0 || ftruncate(fout, total) < 0)
+        {
+            perror("open fout");
+            MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+        }
+    }
+    MPI_Barrier(MPI_COMM_WORLD);
+    if (rank != 0)
+    {
+        fout = open(output_file, O_RDWR);
+        if (fout < 0)
+        {
+            perror("open fout");
+            fprintf(stderr, "Error opening output file: %s\n", output_file);
+            MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+        }
+    }
+    output_shared = 1;
+    output_offset = offset;
+    writeOutput();
+    close(fout);
+}
+
+int main(int argc, char **argv)
+{
+    int provided;
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &ranks);
+
+    char input_file[256] = INPUT_DIR DEFAULT_INPUT_FILE;
+    char sort_method[32] = "mergesort_parallel"; // Default sorting method
+    parseCommandLineArguments(argc, argv, input_file, sort_method);
+    if (requiresPowerOfTwo(sort_method))
+    {
+        if (rank == 0)
+            fprintf(stderr, "Sorting method %s needs a power of two keys per rank and is not available\n",
+                    sort_method);
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+    packed_mode = 1; // Keys travel between ranks as packed integers
+
+    char output_file[256];
+    snprintf(output_file, sizeof(output_file), OUTPUT_DIR "%s.out",
+             strrchr(input_file, '/') ? strrchr(input_file, '/') + 1 : input_file);
+
+    long int total;
+    MPI_Barrier(MPI_COMM_WORLD);
+    double loadStartTime = MPI_Wtime();
+    loadSlice(input_file, &total);
+    double load_time = MPI_Wtime() - loadStartTime;
+
+    MPI_Barrier(MPI_COMM_WORLD);
+    double startTime = MPI_Wtime();
+    if (N > 1)
+        sort(sort_method);
+    double exchangeStartTime = MPI_Wtime();
+    exchangeKeys();
+    double exchange_time = MPI_Wtime() - exchangeStartTime;
+    double total_time = MPI_Wtime() - startTime;
+
+    double writeStartTime = MPI_Wtime();
+    writeSlice(output_file);
+    double write_time = MPI_Wtime() - writeStartTime;
+
+    // The slowest rank sets every time
+    double local[4] = {total_time, load_time, write_time, exchange_time}, slowest[4];
+    MPI_Reduce(local, slowest, 4, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+    if (rank == 0)
+    {
+        if (csv_mode)
+        {
+            printf("input_file,N,task_threshold,omp_num_threads,total_time,load_time,write_time,mpi_ranks,"
+                   "exchange_time\n");
+            printf("%s,%ld,%d,%d,%.6lf,%.6lf,%.6lf,%d,%.6lf\n", input_file, total, task_threshold,
+                   omp_get_max_threads(), slowest[0], slowest[1], slowest[2], ranks, slowest[3]);
+        }
+        else
+        {
+            printf("Load time = %.6lf seconds\n", slowest[1]);
+            printf("Total time = %.6lf seconds (exchange %.6lf seconds)\n", slowest[0], slowest[3]);
+            printf("Write time = %.6lf seconds\n", slowest[2]);
+        }
+    }
+
+    freeBuffer(strings, (N > 0 ? N : 1) * LENGTH);
+    MPI_Finalize();
+    return EXIT_SUCCESS;
+}